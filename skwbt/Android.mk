@@ -19,7 +19,24 @@ LOCAL_SRC_FILES := \
         src/scom_vendor.c \
         src/skw_log.c \
 	src/skw_gen_addr.c \
-	src/skw_btsnoop.c 
+	src/skw_btsnoop.c \
+	src/skw_ring.c \
+	src/skw_nv.c \
+	src/skw_stats.c
+
+
+# Link the nv files into the library, /vendor/etc/bluetooth/*.nvbin then only
+# override them and are not installed by skwbt.mk
+SKWBT_NV_EMBED ?= false
+ifeq ($(SKWBT_NV_EMBED),true)
+SKWBT_NV_DIR := $(LOCAL_PATH)/vendor/etc/bluetooth
+LOCAL_SRC_FILES += src/skw_nv_blob.S
+LOCAL_CFLAGS += -DSKWBT_NV_EMBED=1
+LOCAL_ASFLAGS += \
+	-DSKWBT_NV_6160_FILE=\"$(SKWBT_NV_DIR)/sv6160.nvbin\" \
+	-DSKWBT_NV_6316_FILE=\"$(SKWBT_NV_DIR)/sv6316.nvbin\"
+LOCAL_ADDITIONAL_DEPENDENCIES += $(SKWBT_NV_DIR)/sv6160.nvbin $(SKWBT_NV_DIR)/sv6316.nvbin
+endif
 
 
 LOCAL_C_INCLUDES += \
@@ -46,3 +63,37 @@ LOCAL_PROPRIETARY_MODULE := true
 include $(BUILD_SHARED_LIBRARY)
 
 #PRODUCT_PACKAGES += libbt-vendor-seekwave
+
+
+# Host benchmark of the data path, device nodes are pty pairs driven by a fake
+# controller: mmm <this dir> skwbt_bench, then run skwbt_bench -h
+include $(CLEAR_VARS)
+
+LOCAL_SRC_FILES := \
+        bench/skwbt_bench.c \
+        src/scom_vendor.c \
+        src/skw_log.c \
+	src/skw_gen_addr.c \
+	src/skw_btsnoop.c \
+	src/skw_ring.c \
+	src/skw_nv.c \
+	src/skw_stats.c
+
+LOCAL_C_INCLUDES += \
+        $(LOCAL_PATH)/include \
+	$(BDROID_DIR)/hci/include
+
+LOCAL_HEADER_LIBRARIES := \
+        libcutils_headers \
+        libutils_headers
+
+LOCAL_SHARED_LIBRARIES := \
+        liblog
+
+LOCAL_LDLIBS := -lpthread
+LOCAL_MODULE := skwbt_bench
+LOCAL_MODULE_TAGS := optional
+LOCAL_MODULE_HOST_OS := linux
+
+include $(BUILD_HOST_EXECUTABLE)
+
@@ -0,0 +1,604 @@
+/******************************************************************************
+ *
+ *  Copyright (C) 2020-2021 SeekWave Technology
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ *
+ ******************************************************************************/
+
+/******************************************************************************
+ *
+ *  Filename:      skwbt_bench.c
+ *
+ *  Description:   host benchmark of the vendor lib data path. The device
+ *                 nodes are pty pairs driven by a fake controller, the host
+ *                 end is the socket scomm_vendor_socket_open() returns.
+ *                 ACL packets carry their send time, so every direction
+ *                 gets packets/s, bytes/s and p50/p99 latency, under load
+ *                 and one packet at a time
+ *
+ ******************************************************************************/
+
+#include <pthread.h>
+#include <semaphore.h>
+#include <poll.h>
+#include <termios.h>
+#include <time.h>
+#include <limits.h>
+#include <getopt.h>
+#include <utils/Log.h>
+#include "scom_vendor.h"
+#include "bt_hci_bdroid.h"
+#include "bt_vendor_skw.h"
+#include "skw_btsnoop.h"
+#include "skw_log.h"
+
+#define BENCH_ACL_HDR_LEN       5       //H4 type + ACL header
+#define BENCH_STAMP_LEN         12      //send time + sequence at the head of the payload
+#define BENCH_SKWLOG_LEN        64      //payload of the CP log records with -L
+#define BENCH_SKWLOG_EVERY      16      //one CP log record per this many C2H packets
+#define BENCH_RECV_TIMEOUT_MS   2000    //a direction is given up after this long without data
+#define BENCH_SIZES_MAX         16
+#define BENCH_DEF_SIZES         "32,256,1021,2000"
+
+enum
+{
+    BENCH_H2C = 0,
+    BENCH_C2H,
+    BENCH_DIR_MAX
+};
+
+typedef struct
+{
+    int      master;            //fake controller end
+    int      slave;             //held open, so the raw mode outlives the lib's open/close
+    char     name[DEVICE_NODE_MAX_LEN];
+} bench_pty_st;
+
+typedef struct
+{
+    int      fd;                //where the packets come out
+    uint32_t expect;
+    char     ping;              //post ack_sem for every packet
+    sem_t    ack_sem;
+    uint32_t *lat_ns;
+    uint32_t cnt;
+    uint64_t bytes;
+    uint64_t first_ns;          //send time of the first packet
+    uint64_t last_ns;           //arrival of the last packet
+    uint8_t  buffer[SKW_H4_REASM_BUFFER_SIZE];
+} bench_recv_st;
+
+typedef struct
+{
+    double   pps;
+    double   bps;
+    uint32_t lost;
+    uint32_t p50_us;
+    uint32_t p99_us;
+} bench_result_st;
+
+//what bt_vendor_skw.c provides to the rest of the library
+bt_vendor_callbacks_t *bt_vendor_cbacks = NULL;
+char skwbt_transtype = 0;
+int  btboot_fp = -1;
+int  btpw_fp = -1;
+char btsnoop_log_en = FALSE;
+char btcp_log_en = FALSE;
+char skwlog_slice = FALSE;
+char skwdriverlog_en = FALSE;
+char skwbtuartonly = TRUE;
+char skwbtNoSleep = TRUE;
+
+extern char skw_btsnoop_path[];
+
+static bench_pty_st bench_pty[BT_COM_PORT_SIZE];
+static uint8_t      bench_port_cnt = 0;
+static uint8_t      bench_acl_port = BT_COM_PORT_CMDEVT;
+static int          bench_host_fd = -1;
+static char         bench_skwlog = FALSE;
+
+
+/*******************************************************************************
+**
+** Stub callbacks and properties, the data path does not use libbt
+**
+*******************************************************************************/
+static void bench_fwcfg_cb(bt_vendor_op_result_t result)
+{
+    ALOGD("%s result:%d", __func__, result);
+}
+
+static void *bench_alloc(int size)
+{
+    return malloc(size);
+}
+
+static void bench_dealloc(void *p_buf)
+{
+    free(p_buf);
+}
+
+static uint8_t bench_xmit_cb(uint16_t opcode, void *p_buf, tINT_CMD_CBACK p_cback)
+{
+    free(p_buf);
+    return FALSE;
+}
+
+static bt_vendor_callbacks_t bench_cbacks =
+{
+    sizeof(bt_vendor_callbacks_t),
+    bench_fwcfg_cb,
+    bench_fwcfg_cb,
+    bench_fwcfg_cb,
+    bench_fwcfg_cb,
+    bench_alloc,
+    bench_dealloc,
+    bench_xmit_cb,
+    bench_fwcfg_cb
+};
+
+int property_get(const char *key, char *value, const char *default_value)
+{
+    int len = 0;
+
+    if(default_value)
+    {
+        len = strlen(default_value);
+        memcpy(value, default_value, len + 1);
+    }
+    else
+    {
+        value[0] = 0;
+    }
+    return len;
+}
+
+int property_set(const char *key, const char *value)
+{
+    return 0;
+}
+
+
+static uint64_t bench_now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static char bench_write_all(int fd, const uint8_t *buffer, uint32_t len)
+{
+    ssize_t ret;
+
+    while(len > 0)
+    {
+        ret = write(fd, buffer, len);
+        if(ret < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            ALOGE("%s fd:%d, %s", __func__, fd, strerror(errno));
+            return FALSE;
+        }
+        buffer += ret;
+        len    -= ret;
+    }
+    return TRUE;
+}
+
+/*******************************************************************************
+**
+** Function        bench_pty_open
+**
+** Description     create a raw pty pair, the slave name is the device node
+**                 handed to the vendor lib
+**
+** Returns         TRUE/FALSE
+**
+*******************************************************************************/
+static char bench_pty_open(bench_pty_st *pty)
+{
+    struct termios tio;
+
+    pty->master = posix_openpt(O_RDWR | O_NOCTTY);
+    if((pty->master < 0) || (grantpt(pty->master) != 0) || (unlockpt(pty->master) != 0))
+    {
+        ALOGE("%s posix_openpt fail: %s", __func__, strerror(errno));
+        return FALSE;
+    }
+    snprintf(pty->name, sizeof(pty->name), "%s", ptsname(pty->master));
+    pty->slave = open(pty->name, O_RDWR | O_NOCTTY);
+    if((pty->slave < 0) || (tcgetattr(pty->slave, &tio) != 0))
+    {
+        ALOGE("%s unable to open %s: %s", __func__, pty->name, strerror(errno));
+        return FALSE;
+    }
+    cfmakeraw(&tio);
+    tcsetattr(pty->slave, TCSANOW, &tio);
+    return TRUE;
+}
+
+static void bench_pty_close(bench_pty_st *pty)
+{
+    close(pty->slave);
+    close(pty->master);
+}
+
+/*******************************************************************************
+**
+** Function        bench_lib_open
+**
+** Description     open the ports the way BT_VND_OP_USERIAL_OPEN does, UART:
+**                 one node for everything, SDIO: command/event and ACL nodes
+**
+** Returns         TRUE/FALSE
+**
+*******************************************************************************/
+static char bench_lib_open(char uart)
+{
+    int fd;
+
+    scomm_vendor_init();
+    skwlog_init();
+    if(btsnoop_log_en)
+    {
+        skw_btsnoop_init();
+    }
+
+    skwbt_transtype = SKWBT_TRANS_TYPE_H4 | (uart ? SKWBT_TRANS_TYPE_UART : SKWBT_TRANS_TYPE_SDIO);
+    bench_acl_port  = uart ? BT_COM_PORT_CMDEVT : BT_COM_PORT_ACL;
+    bench_host_fd   = -1;
+    for(uint8_t idx = 0; idx < bench_port_cnt; idx++)
+    {
+        scomm_vendor_set_port_name(idx, bench_pty[idx].name, O_RDWR);
+        fd = uart ? scomm_vendor_uart_open(idx) : scomm_vendor_usbsdio_open(idx);
+        if(fd == -1)
+        {
+            return FALSE;
+        }
+        fd = scomm_vendor_socket_open(idx);
+        if(fd < 0)
+        {
+            return FALSE;
+        }
+        if(idx == BT_COM_PORT_CMDEVT)
+        {
+            bench_host_fd = fd;
+        }
+    }
+    return TRUE;
+}
+
+static void bench_lib_close()
+{
+    scomm_vendor_close();
+    if(btsnoop_log_en)
+    {
+        skw_btsnoop_close();
+    }
+    skwlog_close();
+}
+
+/*******************************************************************************
+**
+** Function        bench_recv_thread
+**
+** Description     reassemble the ACL packets coming out of recv->fd and
+**                 record the latency of each one, other packet types are
+**                 skipped
+**
+** Returns         None
+**
+*******************************************************************************/
+static void *bench_recv_thread(void *arg)
+{
+    bench_recv_st *recv = (bench_recv_st *)arg;
+    struct pollfd pfd = {recv->fd, POLLIN, 0};
+    uint32_t head = 0, tail = 0;
+    uint32_t pkt_len;
+    uint64_t stamp;
+    ssize_t  ret;
+
+    while(recv->cnt < recv->expect)
+    {
+        ret = poll(&pfd, 1, BENCH_RECV_TIMEOUT_MS);
+        if(ret == 0)
+        {
+            ALOGE("%s timeout, got %u of %u", __func__, recv->cnt, recv->expect);
+            break;
+        }
+        if(ret < 0)
+        {
+            if(errno == EINTR)
+            {
+                continue;
+            }
+            break;
+        }
+        ret = read(recv->fd, recv->buffer + tail, sizeof(recv->buffer) - tail);
+        if(ret <= 0)
+        {
+            if((ret < 0) && ((errno == EINTR) || (errno == EAGAIN)))
+            {
+                continue;
+            }
+            break;
+        }
+        tail += ret;
+
+        while((tail - head) >= BENCH_ACL_HDR_LEN)
+        {
+            uint8_t *pkt = recv->buffer + head;
+            if(pkt[0] == HCI_EVENT_PKT)
+            {
+                pkt_len = HCI_EVENT_PKT_PREAMBLE_SIZE + 1 + pkt[HCI_EVENT_DATA_LENGTH_INDEX];
+            }
+            else
+            {
+                pkt_len = BENCH_ACL_HDR_LEN + (pkt[HCI_COMMON_DATA_LENGTH_INDEX] | (pkt[HCI_COMMON_DATA_LENGTH_INDEX + 1] << 8));
+            }
+            if((tail - head) < pkt_len)
+            {
+                break;
+            }
+            if(pkt[0] == HCI_ACLDATA_PKT)
+            {
+                memcpy(&stamp, pkt + BENCH_ACL_HDR_LEN, sizeof(stamp));
+                recv->last_ns = bench_now_ns();
+                recv->lat_ns[recv->cnt++] = (uint32_t)(recv->last_ns - stamp);
+                recv->bytes += pkt_len;
+                if(recv->ping)
+                {
+                    sem_post(&recv->ack_sem);
+                }
+            }
+            head += pkt_len;
+        }
+        if(head == tail)
+        {
+            head = tail = 0;
+        }
+        else if(tail == sizeof(recv->buffer))
+        {
+            memmove(recv->buffer, recv->buffer + head, tail - head);
+            tail -= head;
+            head  = 0;
+        }
+    }
+    if(recv->ping)
+    {
+        sem_post(&recv->ack_sem);//release a sender waiting on a lost packet
+    }
+    return NULL;
+}
+
+static int bench_cmp_u32(const void *a, const void *b)
+{
+    uint32_t x = *(const uint32_t *)a;
+    uint32_t y = *(const uint32_t *)b;
+    return (x > y) - (x < y);
+}
+
+/*******************************************************************************
+**
+** Function        bench_run
+**
+** Description     send count ACL packets of size payload bytes in one
+**                 direction, back to back or, with ping, one at a time
+**
+** Returns         TRUE if the run could be started
+**
+*******************************************************************************/
+static char bench_run(uint8_t dir, uint16_t size, uint32_t count, char ping, bench_result_st *result)
+{
+    static bench_recv_st recv;
+    uint8_t  pkt[BENCH_ACL_HDR_LEN + 2048];
+    uint8_t  log_pkt[4 + BENCH_SKWLOG_LEN];
+    int      tx_fd = (dir == BENCH_H2C) ? bench_host_fd : bench_pty[bench_acl_port].master;
+    pthread_t thread_id;
+    struct timespec ts;
+    uint64_t now_ns;
+    uint32_t i;
+
+    memset(result, 0, sizeof(*result));
+    memset(&recv, 0, sizeof(recv));
+    recv.fd     = (dir == BENCH_H2C) ? bench_pty[bench_acl_port].master : bench_host_fd;
+    recv.expect = count;
+    recv.ping   = ping;
+    recv.lat_ns = malloc(count * sizeof(uint32_t));
+    if(recv.lat_ns == NULL)
+    {
+        return FALSE;
+    }
+    sem_init(&recv.ack_sem, 0, 0);
+    if(pthread_create(&thread_id, NULL, bench_recv_thread, &recv) != 0)
+    {
+        free(recv.lat_ns);
+        return FALSE;
+    }
+
+    memset(pkt, 0, sizeof(pkt));
+    pkt[0] = HCI_ACLDATA_PKT;
+    pkt[1] = 0x01;              //handle 0x001, first automatically flushable
+    pkt[2] = 0x20;
+    pkt[3] = (uint8_t)size;
+    pkt[4] = (uint8_t)(size >> 8);
+
+    memset(log_pkt, 0x5A, sizeof(log_pkt));
+    log_pkt[0] = HCI_EVENT_SKWLOG;
+    log_pkt[1] = 0;
+    log_pkt[2] = (uint8_t)BENCH_SKWLOG_LEN;
+    log_pkt[3] = 0;
+
+    recv.first_ns = bench_now_ns();
+    for(i = 0; i < count; i++)
+    {
+        if(bench_skwlog && (dir == BENCH_C2H) && ((i % BENCH_SKWLOG_EVERY) == 0))
+        {
+            bench_write_all(tx_fd, log_pkt, sizeof(log_pkt));
+        }
+        now_ns = bench_now_ns();
+        memcpy(pkt + BENCH_ACL_HDR_LEN, &now_ns, sizeof(now_ns));
+        memcpy(pkt + BENCH_ACL_HDR_LEN + sizeof(now_ns), &i, sizeof(i));
+        if(!bench_write_all(tx_fd, pkt, BENCH_ACL_HDR_LEN + size))
+        {
+            break;
+        }
+        if(ping)
+        {
+            clock_gettime(CLOCK_REALTIME, &ts);
+            ts.tv_sec += BENCH_RECV_TIMEOUT_MS / 1000;
+            if((sem_timedwait(&recv.ack_sem, &ts) != 0) || (recv.cnt <= i))
+            {
+                break;//lost, the receiver has given up
+            }
+        }
+    }
+    pthread_join(thread_id, NULL);
+    sem_destroy(&recv.ack_sem);
+
+    result->lost = count - recv.cnt;
+    if(recv.cnt > 0)
+    {
+        double secs = (double)(recv.last_ns - recv.first_ns) / 1e9;
+        result->pps = recv.cnt / secs;
+        result->bps = recv.bytes / secs;
+        qsort(recv.lat_ns, recv.cnt, sizeof(uint32_t), bench_cmp_u32);
+        result->p50_us = recv.lat_ns[(recv.cnt - 1) * 50 / 100] / 1000;
+        result->p99_us = recv.lat_ns[(recv.cnt - 1) * 99 / 100] / 1000;
+    }
+    free(recv.lat_ns);
+    return TRUE;
+}
+
+static void bench_usage(const char *name)
+{
+    printf("usage: %s [-m uart|sdio] [-s sizes] [-n count] [-p ping_count] [-S] [-L] [-d log_dir]\n"
+           "  -m  transport, uart: one node, sdio: command/event and ACL nodes (default sdio)\n"
+           "  -s  ACL payload sizes, comma separated, %d..2048 (default " BENCH_DEF_SIZES ")\n"
+           "  -n  packets per back to back run (default 20000)\n"
+           "  -p  packets per one at a time run (default 2000)\n"
+           "  -S  only run with btsnoop on, default is off and on\n"
+           "  -L  CP log on, the controller adds a log record every %d packets\n"
+           "  -d  directory of the btsnoop/CP log files (default /tmp)\n",
+           name, BENCH_STAMP_LEN, BENCH_SKWLOG_EVERY);
+}
+
+int main(int argc, char *argv[])
+{
+    static const char *dir_names[BENCH_DIR_MAX] = {"h2c", "c2h"};
+    char     uart = FALSE;
+    char     snoop_only = FALSE;
+    const char *size_list = BENCH_DEF_SIZES;
+    const char *log_dir = "/tmp";
+    uint16_t sizes[BENCH_SIZES_MAX];
+    uint8_t  size_cnt = 0;
+    uint32_t count = 20000;
+    uint32_t ping_count = 2000;
+    char     *end;
+    int      opt;
+    int      ret = 0;
+
+    while((opt = getopt(argc, argv, "m:s:n:p:SLd:h")) != -1)
+    {
+        switch(opt)
+        {
+            case 'm':
+                uart = (strcmp(optarg, "uart") == 0);
+                break;
+            case 's':
+                size_list = optarg;
+                break;
+            case 'n':
+                count = strtoul(optarg, NULL, 0);
+                break;
+            case 'p':
+                ping_count = strtoul(optarg, NULL, 0);
+                break;
+            case 'S':
+                snoop_only = TRUE;
+                break;
+            case 'L':
+                bench_skwlog = TRUE;
+                break;
+            case 'd':
+                log_dir = optarg;
+                break;
+            default:
+                bench_usage(argv[0]);
+                return (opt == 'h') ? 0 : 1;
+        }
+    }
+
+    for(const char *p = size_list; *p && (size_cnt < BENCH_SIZES_MAX); p = (*end == ',') ? end + 1 : end)
+    {
+        unsigned long size = strtoul(p, &end, 0);
+        if((end == p) || (size < BENCH_STAMP_LEN) || (size > 2048))
+        {
+            bench_usage(argv[0]);
+            return 1;
+        }
+        sizes[size_cnt++] = (uint16_t)size;
+    }
+    if((count == 0) || (ping_count == 0))
+    {
+        bench_usage(argv[0]);
+        return 1;
+    }
+
+    bench_port_cnt = uart ? 1 : (BT_COM_PORT_ACL + 1);
+    for(uint8_t idx = 0; idx < bench_port_cnt; idx++)
+    {
+        if(!bench_pty_open(&bench_pty[idx]))
+        {
+            return 1;
+        }
+    }
+    bt_vendor_cbacks = &bench_cbacks;
+    snprintf(skw_btsnoop_path, PATH_MAX, "%s/btsnoop_hci.log", log_dir);
+    btcp_log_en = bench_skwlog;
+
+    for(char snoop = snoop_only; snoop <= TRUE; snoop++)
+    {
+        btsnoop_log_en = snoop;
+        if(!bench_lib_open(uart))
+        {
+            ALOGE("%s unable to open the vendor lib ports", __func__);
+            ret = 1;
+            break;
+        }
+
+        printf("\nmode:%s snoop:%s cplog:%s, back to back:%u, one at a time:%u\n", uart ? "uart" : "sdio",
+               snoop ? "on" : "off", bench_skwlog ? "on" : "off", count, ping_count);
+        printf("dir  size   pkts/s      MB/s     p50us   p99us   lost | idle p50us  p99us   lost\n");
+        for(uint8_t dir = 0; dir < BENCH_DIR_MAX; dir++)
+        {
+            for(uint8_t s = 0; s < size_cnt; s++)
+            {
+                bench_result_st load, idle;
+                if(!bench_run(dir, sizes[s], count, FALSE, &load) || !bench_run(dir, sizes[s], ping_count, TRUE, &idle))
+                {
+                    ret = 1;
+                    continue;
+                }
+                printf("%s  %-5u  %-10.0f  %-7.2f  %-6u  %-6u  %-5u | %-10u  %-6u  %u\n", dir_names[dir], sizes[s],
+                       load.pps, load.bps / 1e6, load.p50_us, load.p99_us, load.lost, idle.p50_us, idle.p99_us, idle.lost);
+                if(load.lost || idle.lost)
+                {
+                    ret = 1;
+                }
+            }
+        }
+        fflush(stdout);
+        bench_lib_close();
+    }
+
+    for(uint8_t idx = 0; idx < bench_port_cnt; idx++)
+    {
+        bench_pty_close(&bench_pty[idx]);
+    }
+    return ret;
+}
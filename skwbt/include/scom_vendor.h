@@ -10,6 +10,10 @@
 #define __SCOM_VENDOR_H__
 
 #include <sys/types.h>
+#include <pthread.h>
+#include <termios.h>
+#include "skw_ring.h"
+#include "skw_nv.h"
 
 
 /* Structure used to configure serial port during open */
@@ -25,6 +29,7 @@ typedef struct
 enum {
 	HW_CFG_INIT = 0x00,
     HW_CFG_START,
+    HW_CFG_SET_UART_BAUD,
     HW_CFG_WRITE_OS_TYPE,
     HW_CFG_READ_HCI_VERSION,
     HW_CFG_NV_SEND,
@@ -36,7 +41,24 @@ enum {
 
 #define HCI_CMD_MAX_LEN       258
 
+#define SKW_H4_REASM_BUFFER_SIZE 8192 //H4 data reassembly buffer
+#define SKW_HOST_IOV_MAX         64   //max packets per writev to host
+#define SKW_HOST_FAST_SLOTS      64   //SCO/ISO packets queued ahead of bulk data
+#define SKW_HOST_FAST_PKT_LEN    1024 //longer SCO/ISO packets take the bulk path
+#define SKW_TX_RING_SLOTS        64   //host packets queued per device node
+#define SKW_TX_PKT_LEN           2056 //max host packet, H4 header + 2048 bytes payload
+#define SKW_BT_STATE_WAIT_MS     100  //bound for flushing the BT state command at close
+
+#define SKW_THREAD_START_WAIT_MS 1000 //max wait for a recv thread to start
+#define SKW_THREAD_EXIT_WAIT_MS  5    //wait per driver kick for a recv thread to exit
+
 #define NV_FILE_RD_BLOCK_SIZE 252
+//max NVDS commands in flight. The libbt vendor interface keeps the callback
+//of one internal command only and hands further Command Completes to the
+//stack, raise it only with a transport that routes every completion back
+#ifndef NV_PIPELINE_WINDOW_MAX
+#define NV_PIPELINE_WINDOW_MAX 1
+#endif
 #define DEVICE_NODE_MAX_LEN   64
 
 #define NV_TAG_BD_ADDR        0x01
@@ -52,12 +74,45 @@ enum{
 
 typedef struct
 {
-    uint32_t    baudrate; //for UART
+    uint32_t    baudrate; //for UART, rate the controller is switched to after reset
+    uint8_t     baud_cfg;       //USERIAL_BAUD_xxx of baudrate
     uint8_t     state;          /* Hardware configuration state mechine*/
-	uint8_t     file_offset;//for nv
-	FILE *      nv_fp;
+	uint16_t    nv_cmd_idx; //index of the next NVDS command
+	const skw_nv_image_st *nv_image;
+	uint8_t     cmd_credits;    //Num_HCI_Command_Packets of the last event
+	uint8_t     nv_inflight;    //NVDS commands not completed yet
+	char        nv_eof;         //the whole nv file is sent
+	uint64_t    nv_start_us;
 } bt_hw_cfg_cb_st;
 
+typedef struct
+{
+    uint8_t  buffer[SKW_H4_REASM_BUFFER_SIZE];
+    uint16_t head;              //first byte not consumed yet
+    uint16_t tail;              //end of the valid data
+} skw_h4_reasm_st;
+
+typedef struct{
+  int  fd;                              // the file descriptor to monitor for events.
+  void *context;                       // a context that's passed back to the *_ready functions..
+  pthread_mutex_t lock;                // protects the lifetime of this object and all variables.
+
+  void (*read_ready)(void *context);   // function to call when the file descriptor becomes readable.
+  void (*write_ready)(void *context);  // function to call when the file descriptor becomes writeable.
+}skw_socket_object_st;
+
+typedef struct
+{
+    skw_ring_st ring;           //host packets waiting for the device node
+    skw_socket_object_st object;//EPOLLOUT handler of the device node
+    uint8_t    *cur_data;       //packet being written, claimed from the ring
+    uint32_t    cur_pos;
+    uint32_t    cur_len;
+    uint32_t    offset;         //bytes of cur_data already written
+    char        armed;          //device node is in the epoll set
+    uint64_t    stamp_us[SKW_TX_RING_SLOTS];//arrival time of the queued packets
+} skw_tx_ctx_st;
+
 typedef struct
 {
     int fd;                     //
@@ -72,24 +127,20 @@ typedef struct
     pthread_t thread_uart_id;
     char thread_running;
     char recv_comm_thread_running;
-	char is_busying;
+	pthread_mutex_t state_lock; //protects recv_comm_thread_running
+	pthread_cond_t  state_cond; //signalled when the recv thread starts or exits
 
 	volatile char  driver_state;
 	int mode;
+	skw_h4_reasm_st host_rx;    //data from host, H4 format
+	skw_h4_reasm_st scomm_rx;   //data from controller, H4 format
+	skw_tx_ctx_st   tx;         //host packets for this device node
 } scomm_vnd_st;
 
-typedef struct{
-  int  fd;                              // the file descriptor to monitor for events.
-  void *context;                       // a context that's passed back to the *_ready functions..
-  pthread_mutex_t lock;                // protects the lifetime of this object and all variables.
-
-  void (*read_ready)(void *context);   // function to call when the file descriptor becomes readable.
-  void (*write_ready)(void *context);  // function to call when the file descriptor becomes writeable.
-}skw_socket_object_st;
-
 
 
 #define HCI_CMD_PREAMBLE_SIZE                    3
+#define HCI_EVT_CMD_CMPL_NUM_PKTS_OFFSET         2     //Num_HCI_Command_Packets's offset in HCI_Command_Complete Event
 #define HCI_EVT_CMD_CMPL_OPCODE_OFFSET           3     //opcode's offset in HCI_Command_Complete Event
 #define HCI_EVT_CMD_CMPL_STATUS_OFFSET           5     //status's offset in HCI_Command_Complete Event
 
@@ -138,6 +189,15 @@ typedef struct{
 #define HCI_EVENT_DATA_LENGTH_INDEX   0x02
 #define HCI_SKWLOG_DATA_LENGTH_INDEX  0x02
 
+#define HCI_HANDLE_MAX                0x0EFF //largest valid connection handle
+
+/* resync candidate check */
+enum{
+    SKW_RESYNC_BAD = 0,
+    SKW_RESYNC_UNSURE,
+    SKW_RESYNC_OK
+};
+
 
 
 //---------------------UART Para Start-------------------------//
@@ -195,6 +255,8 @@ uint8_t scomm_vendor_check_port_valid(uint8_t port_index);
 
 int scomm_vendor_uart_open(uint8_t port_index);
 
+uint8_t scomm_vendor_baud_cfg(uint32_t rate, uint8_t *cfg_baud);
+
 int scomm_vendor_usbsdio_open(uint8_t port_index);
 
 int scomm_vendor_socket_open(uint8_t port_index);
@@ -39,9 +39,18 @@
 #define HCI_EVENT_SKWLOG	0x07
 
 
+#define SKW_BTSNOOP_REC_HDR_SIZE    24      //length, included length, flags, drops, timestamp
+#define SKW_BTSNOOP_RING_SLOTS      256     //records buffered for the writer thread
+#define SKW_BTSNOOP_MAX_PKT_LEN     1100    //longer packets are truncated in the log
+#define SKW_BTSNOOP_BATCH_SIZE      64      //records per writev
+#define SKW_BTSNOOP_SEG_CNT_DEF     4       //segments kept when segment mode is on
+#define SKW_BTSNOOP_SEG_SIZE_MAX    1024    //MB
+
+
 void skw_btsnoop_init();
 void skw_btsnoop_close(void);
 void skw_btsnoop_capture(const uint8_t *packet, char is_received);
+uint32_t skw_btsnoop_drops();
 
 
 
@@ -30,6 +30,10 @@
 #define UINT16_TO_STREAM(p, u16) {*(p)++ = (uint8_t)(u16); *(p)++ = (uint8_t)((u16) >> 8);}
 #endif
 
+#ifndef UINT32_TO_STREAM
+#define UINT32_TO_STREAM(p, u32) {*(p)++ = (uint8_t)(u32); *(p)++ = (uint8_t)((u32) >> 8); *(p)++ = (uint8_t)((u32) >> 16); *(p)++ = (uint8_t)((u32) >> 24);}
+#endif
+
 #ifndef STREAM_TO_UINT16
 #define STREAM_TO_UINT16(u16, p) {u16 = ((uint16_t)(*(p)) + (((uint16_t)(*((p) + 1))) << 8)); (p) += 2;}
 #endif
@@ -39,6 +43,7 @@
 
 
 extern char skwdriverlog_en;
+#define SKWBT_LOG_HEX_MAX   64  //bytes of a packet dumped in hex, only formatted when the driver log is on
 #define SKWBT_LOG(fmt, args...)  do{if(skwdriverlog_en){ALOGD("[SKWBT]:" fmt, ## args);}}while(0)
 
 #endif
@@ -9,6 +9,12 @@
 #ifndef __SKW_LOG_H__
 #define __SKW_LOG_H__
 
+#include <stdint.h>
+
+#define SKWLOG_RING_SLOTS       128     //CP log records buffered for the writer thread
+#define SKWLOG_MAX_PKT_LEN      2048    //longer records are dropped
+#define SKWLOG_BATCH_SIZE       64      //records per writev
+
 void skwlog_init();
 
 void skwlog_reopen(char new_file);
@@ -17,6 +23,8 @@ void skwlog_print_current_time();
 
 void skwlog_write(unsigned char *buffer, unsigned int length);
 
+void skwlog_get_drops(uint32_t *evicts, uint32_t *lost, uint32_t *oversize);
+
 void skwlog_close();
 
 
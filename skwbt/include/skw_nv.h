@@ -0,0 +1,53 @@
+/******************************************************************************
+ *
+ *  Copyright (C) 2020-2021 SeekWave Technology
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ *
+ ******************************************************************************/
+
+#ifndef __SKW_NV_H__
+#define __SKW_NV_H__
+
+#include <stdint.h>
+#include <time.h>
+#include <sys/types.h>
+
+#ifndef SKWBT_NV_EMBED
+#define SKWBT_NV_EMBED        0
+#endif
+
+#define NV_CMD_MAX_CNT        256   //file offset field of the command is one byte
+#define NV_6316_HEADER_LEN    4
+#define NV_6160_ADDR_OFFSET   7     //bd addr in the first block
+#define NV_6160_FLAG_OFFSET   62    //flag byte in the second block
+
+
+/*
+ * NV file parsed into ready to send HCI_CMD_SKW_BT_NVDS commands.
+ * cmds holds cmd_cnt packed commands [opcode, len, offset, para len, params],
+ * the image is kept across enable/disable and rebuilt when the file changes.
+ */
+typedef struct
+{
+    uint16_t chip_id;
+    char     embedded;      //built from the nv data linked into the library
+    time_t   mtime;
+    off_t    size;
+    uint8_t *cmds;
+    uint32_t used;
+    uint16_t cmd_cnt;
+    uint32_t cmd_off[NV_CMD_MAX_CNT];
+    uint16_t cmd_len[NV_CMD_MAX_CNT];
+    int32_t  addr_pos;      //offset of the patched bd addr in cmds, -1: none
+    uint8_t  addr[3];
+} skw_nv_image_st;
+
+
+const skw_nv_image_st *skw_nv_load(uint16_t chip_id, const char *file_name);
+
+uint16_t skw_nv_get_cmd(const skw_nv_image_st *image, uint16_t index, uint8_t *buffer);
+
+void skw_nv_free();
+
+#endif
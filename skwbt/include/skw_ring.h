@@ -0,0 +1,60 @@
+/******************************************************************************
+ *
+ *  Copyright (C) 2020-2021 SeekWave Technology
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ *
+ ******************************************************************************/
+
+#ifndef __SKW_RING_H__
+#define __SKW_RING_H__
+
+#include <stdint.h>
+#include <stdatomic.h>
+
+/*
+ * Bounded lock-free record ring with fixed size slots.
+ * Any thread may put records, the logger thread takes them out; every slot
+ * carries a sequence number so a producer never waits for another one.
+ */
+typedef struct
+{
+    atomic_uint seq;
+    uint32_t    len;
+    uint8_t     data[];
+} skw_ring_slot_st;
+
+typedef struct
+{
+    uint8_t    *buffer;
+    uint32_t    slot_cnt;       //power of 2
+    uint32_t    slot_size;      //skw_ring_slot_st + data size
+    uint32_t    data_size;      //max record length
+    atomic_uint enqueue_pos;
+    atomic_uint dequeue_pos;
+    atomic_uint drops;          //records lost because the ring was full
+    atomic_uint evicts;         //old records thrown away by skw_ring_reserve_evict
+} skw_ring_st;
+
+#define SKW_RING_EVICT_TRIES    4
+
+
+char skw_ring_init(skw_ring_st *ring, uint32_t slot_cnt, uint32_t data_size);
+
+void skw_ring_deinit(skw_ring_st *ring);
+
+uint8_t *skw_ring_try_reserve(skw_ring_st *ring, uint32_t *pos);
+
+uint8_t *skw_ring_reserve(skw_ring_st *ring, uint32_t *pos);
+
+uint8_t *skw_ring_reserve_evict(skw_ring_st *ring, uint32_t *pos);
+
+void skw_ring_commit(skw_ring_st *ring, uint32_t pos, uint32_t len);
+
+uint8_t *skw_ring_claim(skw_ring_st *ring, uint32_t *pos, uint32_t *len);
+
+void skw_ring_release(skw_ring_st *ring, uint32_t pos);
+
+char skw_ring_is_empty(skw_ring_st *ring);
+
+#endif
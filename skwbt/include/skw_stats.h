@@ -0,0 +1,73 @@
+/******************************************************************************
+ *
+ *  Copyright (C) 2020-2021 SeekWave Technology
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ *
+ ******************************************************************************/
+
+#ifndef __SKW_STATS_H__
+#define __SKW_STATS_H__
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdatomic.h>
+
+/*
+ * Data path counters of one BT session, kept lock-free per device node by
+ * the threads that move the packets. Latency runs from the read() a packet
+ * arrived with to the write() that handed it on, bucket n counts latencies
+ * below 2^n us.
+ */
+#define SKW_STATS_PORT_MAX      4   //BT_COM_PORT_SIZE
+#define SKW_STATS_TYPE_MAX      8   //H4 packet type, HCI_COMMAND_PKT..HCI_EVENT_SKWLOG
+#define SKW_STATS_LAT_BUCKETS   24
+
+#define SKW_STATS_DUMP_FILE     "skwbt_stats.txt"           //in the btsnoop log directory
+#define SKW_STATS_DUMP_PROP     "vendor.skwbt.stats.dump"   //set to 1 to dump the stats
+#define SKW_STATS_CLOSE_PROP    "persist.vendor.skwbt.stats.close" //set to 1 to dump the stats when BT is turned off
+#define SKW_STATS_SUMMARY_PROP  "vendor.skwbt.stats"        //one line summary, updated by a dump
+#define SKW_STATS_POLL_US       1000000                     //dump request check interval
+
+enum
+{
+    SKW_STATS_H2C = 0,  //host to controller
+    SKW_STATS_C2H,      //controller to host
+    SKW_STATS_DIR_MAX
+};
+
+enum
+{
+    SKW_STATS_DISCARDS = 0,     //bytes thrown away looking for a valid packet type
+    SKW_STATS_PARTIAL_READS,    //reads that ended inside a packet
+    SKW_STATS_WRITE_RETRIES,    //writes the device node took only partly or not at all
+    SKW_STATS_HOST_RETRIES,     //partial writes to the host socket
+    SKW_STATS_CNT_MAX
+};
+
+typedef struct
+{
+    atomic_uint_fast64_t pkts[SKW_STATS_DIR_MAX][SKW_STATS_TYPE_MAX];
+    atomic_uint_fast64_t bytes[SKW_STATS_DIR_MAX][SKW_STATS_TYPE_MAX];
+    atomic_uint_fast64_t first_us[SKW_STATS_DIR_MAX];  //arrival of the first packet
+    atomic_uint_fast64_t last_us[SKW_STATS_DIR_MAX];   //hand over of the last packet
+    atomic_uint          lat[SKW_STATS_DIR_MAX][SKW_STATS_LAT_BUCKETS];
+    atomic_uint          cnt[SKW_STATS_CNT_MAX];
+} skw_stats_port_st;
+
+
+void skw_stats_reset();
+
+void skw_stats_pkt(uint8_t port, uint8_t dir, uint8_t type, uint32_t len);
+
+void skw_stats_lat(uint8_t port, uint8_t dir, uint32_t pkts, uint64_t start_us, uint64_t end_us);
+
+void skw_stats_inc(uint8_t port, uint8_t cnt, uint32_t val);
+
+void skw_stats_report();
+
+int skw_stats_summary(char *buf, size_t size);
+
+char skw_stats_dump(const char *path);
+
+#endif
@@ -4,8 +4,11 @@ CUR_PATH := hardware/seekwave/skwbt
 
 
 PRODUCT_COPY_FILES += $(CUR_PATH)/vendor/etc/bluetooth/skwbt.conf:vendor/etc/bluetooth/skwbt.conf
+#with SKWBT_NV_EMBED the nv files are linked into libbt-vendor-seekwave
+ifneq ($(SKWBT_NV_EMBED),true)
 PRODUCT_COPY_FILES += $(CUR_PATH)/vendor/etc/bluetooth/sv6160.nvbin:vendor/etc/bluetooth/sv6160.nvbin
 PRODUCT_COPY_FILES += $(CUR_PATH)/vendor/etc/bluetooth/sv6316.nvbin:vendor/etc/bluetooth/sv6316.nvbin
+endif
 
 
 
@@ -26,6 +26,8 @@
 #include "skw_gen_addr.h"
 #include "skw_common.h"
 #include <cutils/properties.h>
+#include <stddef.h>
+#include <limits.h>
 
 #define SKWBT_CONFIG_FILE       "/vendor/etc/bluetooth/skwbt.conf"
 
@@ -34,7 +36,6 @@ uint8_t vnd_local_bd_addr[6] = {0x00, 0x00, 0x00, 0x00, 0x00, 0x00};
 uint8_t port_cnts = 0;
 
 char skwbt_transtype = 0;
-static char skwbt_device_node[BT_COM_PORT_SIZE][DEVICE_NODE_MAX_LEN];
 
 int  btboot_fp = -1;
 int  btpw_fp = -1;
@@ -47,224 +48,350 @@ char skwbtNoSleep = FALSE; //No Sleep
 
 extern char skw_btsnoop_path[];
 extern char btsnoop_save_log;
+extern uint32_t btsnoop_seg_size;
+extern uint32_t btsnoop_seg_cnt;
+extern uint8_t skw_nv_window;
+extern uint32_t skw_uart_baud;
+extern uint16_t skw_uart_baud_opcode;
 
-static char *trim(char *str)
-{
-    while (isspace(*str))
-    {
-        ++str;
-    }
-
-    if (!*str)
-    {
-        return str;
-    }
+#define SKWBT_CONF_LINE_MAX     1024
 
-    char *end_str = str + strlen(str) - 1;
-    while (end_str > str && isspace(*end_str))
-    {
-        --end_str;
-    }
-
-    end_str[1] = '\0';
-    return str;
+typedef enum
+{
+    SKWBT_CONF_BOOL,
+    SKWBT_CONF_INT,
+    SKWBT_CONF_STR,
+    SKWBT_CONF_NODE
+} skwbt_conf_type_e;
+
+//everything skwbt.conf sets, parsed once and kept as a snapshot for later init() calls
+typedef struct
+{
+    uint8_t node_cnt;
+    char    uart_node;//first BtDeviceNode starts with '?'
+    char    device_node[BT_COM_PORT_SIZE][DEVICE_NODE_MAX_LEN];
+    char    snoop_dump;
+    char    snoop_save_log;
+    char    snoop_path[1024];
+    int     snoop_seg_size;//MB, 0:single file mode
+    int     snoop_seg_cnt;
+    int     nv_window;
+    int     uart_baud;//bps the UART is switched to after reset, 0:keep the open rate
+    int     uart_baud_opcode;//vendor command that sets the controller rate, 0:none
+    char    cp_log;
+    char    log_slice;
+    char    drv_log;
+    char    uart_only;
+    char    no_sleep;
+} skwbt_conf_st;
+
+typedef struct
+{
+    const char        *key;
+    uint8_t            key_len;
+    skwbt_conf_type_e  type;
+    size_t             offset;
+    size_t             size;
+    int                min;//SKWBT_CONF_INT valid range
+    int                max;
+    char               clamp;//clamp an out of range value instead of rejecting it
+} skwbt_conf_key_st;
+
+#define SKWBT_CONF_KEY(key, type, field, min, max, clamp) \
+    {key, sizeof(key) - 1, type, offsetof(skwbt_conf_st, field), sizeof(((skwbt_conf_st *)0)->field), min, max, clamp}
+
+static const skwbt_conf_key_st skwbt_conf_keys[] =
+{
+    SKWBT_CONF_KEY("BtDeviceNode",        SKWBT_CONF_NODE, device_node,    0, 0,                        FALSE),
+    SKWBT_CONF_KEY("SkwBtsnoopDump",      SKWBT_CONF_BOOL, snoop_dump,     0, 0,                        FALSE),
+    SKWBT_CONF_KEY("BtSnoopFileName",     SKWBT_CONF_STR,  snoop_path,     0, 0,                        FALSE),
+    SKWBT_CONF_KEY("BtSnoopSaveLog",      SKWBT_CONF_BOOL, snoop_save_log, 0, 0,                        FALSE),
+    SKWBT_CONF_KEY("BtSnoopSegmentSize",  SKWBT_CONF_INT,  snoop_seg_size, 0, SKW_BTSNOOP_SEG_SIZE_MAX, FALSE),
+    SKWBT_CONF_KEY("BtSnoopSegmentCount", SKWBT_CONF_INT,  snoop_seg_cnt,  1, INT_MAX,                  FALSE),
+    SKWBT_CONF_KEY("SkwNvWindow",         SKWBT_CONF_INT,  nv_window,      1, NV_PIPELINE_WINDOW_MAX,   TRUE),
+    SKWBT_CONF_KEY("SkwUartBaudRate",     SKWBT_CONF_INT,  uart_baud,      0, 4000000,                  FALSE),
+    SKWBT_CONF_KEY("SkwUartBaudOpcode",   SKWBT_CONF_INT,  uart_baud_opcode, 0, 0xFFFF,                 FALSE),
+    SKWBT_CONF_KEY("SkwBtcplog",          SKWBT_CONF_BOOL, cp_log,         0, 0,                        FALSE),
+    SKWBT_CONF_KEY("SkwLogSlice",         SKWBT_CONF_BOOL, log_slice,      0, 0,                        FALSE),
+    SKWBT_CONF_KEY("SkwBtDrvlog",         SKWBT_CONF_BOOL, drv_log,        0, 0,                        FALSE),
+    SKWBT_CONF_KEY("SkwBtUartOnly",       SKWBT_CONF_BOOL, uart_only,      0, 0,                        FALSE),
+    SKWBT_CONF_KEY("SkwBtNoSleep",        SKWBT_CONF_BOOL, no_sleep,       0, 0,                        FALSE),
+};
+
+static skwbt_conf_st skwbt_conf;
+static char          skwbt_conf_valid = FALSE;
+static time_t        skwbt_conf_mtime;
+static off_t         skwbt_conf_size;
+
+static void skwbt_conf_defaults(skwbt_conf_st *conf)
+{
+    memset(conf, 0, sizeof(skwbt_conf_st));
+    conf->snoop_seg_cnt = SKW_BTSNOOP_SEG_CNT_DEF;
+    conf->nv_window     = 1;
+    conf->drv_log       = TRUE;
+    conf->uart_only     = TRUE;
 }
 
-
-static void load_skwbt_conf()
+static const skwbt_conf_key_st *skwbt_conf_find(const char *key, size_t key_len)
 {
-    memset(skwbt_device_node, 0, sizeof(skwbt_device_node));
-    FILE *fp = fopen(SKWBT_CONFIG_FILE, "rt");
-    if (!fp)
+    for(size_t i = 0; i < sizeof(skwbt_conf_keys) / sizeof(skwbt_conf_keys[0]); i++)
     {
-        //ALOGE("%s unable to open file '%s': %s", __func__, SKWBT_CONFIG_FILE, strerror(errno));
-        strcpy(skwbt_device_node[0], "/dev/ttyS0");
-        return ;
+        if((skwbt_conf_keys[i].key_len == key_len) && !memcmp(skwbt_conf_keys[i].key, key, key_len))
+        {
+            return &skwbt_conf_keys[i];
+        }
     }
+    return NULL;
+}
 
-    char *split;
-    char line[1024];
-    int port_index = BT_COM_PORT_CMDEVT;
+//returns FALSE if the value is not valid for the key, the field is left untouched then
+static char skwbt_conf_set(skwbt_conf_st *conf, const skwbt_conf_key_st *entry, char *value, size_t value_len)
+{
+    char *field = (char *)conf + entry->offset;
 
-    while (fgets(line, sizeof(line), fp))
+    switch(entry->type)
     {
-        char *line_ptr = trim(line);
+        case SKWBT_CONF_BOOL:
+            if(!strcmp(value, "true"))
+            {
+                *field = TRUE;
+            }
+            else if(!strcmp(value, "false"))
+            {
+                *field = FALSE;
+            }
+            else
+            {
+                return FALSE;
+            }
+            break;
 
-        // Skip blank and comment lines.
-        if (*line_ptr == '\0' || *line_ptr == '#' || *line_ptr == '[')
+        case SKWBT_CONF_INT:
         {
-            continue;
-        }
+            char *end;
+            long val;
 
-        split = strchr(line_ptr, '=');
-        if (!split)
-        {
-            ALOGE("%s no key/value separator found", __func__);
-            fclose(fp);
-            return;
+            errno = 0;
+            //decimal, or hex with a 0x prefix
+            val = strtol(value, &end, ((value[0] == '0') && ((value[1] == 'x') || (value[1] == 'X'))) ? 16 : 10);
+            if((*end != '\0') || (errno != 0))
+            {
+                return FALSE;
+            }
+            if((val < entry->min) || (val > entry->max))
+            {
+                if(!entry->clamp)
+                {
+                    return FALSE;
+                }
+                ALOGE("%s %s=%ld out of range %d..%d, %d is used", __func__, entry->key, val, entry->min, entry->max,
+                      (val < entry->min) ? entry->min : entry->max);
+                val = (val < entry->min) ? entry->min : entry->max;
+            }
+            *(int *)field = (int)val;
         }
+        break;
+
+        case SKWBT_CONF_STR:
+            if(value_len >= entry->size)
+            {
+                return FALSE;
+            }
+            memcpy(field, value, value_len + 1);
+            break;
 
-        *split = '\0';
-        split ++;
-        if(!strcmp(trim(line_ptr), "BtDeviceNode"))
+        case SKWBT_CONF_NODE:
         {
-            int mode = O_RDWR;
-#if 0
-            if(strstr(split, "BTDATA"))
+            char uart_node = FALSE;
+            if(conf->node_cnt >= BT_COM_PORT_SIZE)
             {
-                port_index = BT_COM_PORT_ACL;
+                return FALSE;
             }
-            else if(strstr(split, "BTAUDIO"))
+            if((conf->node_cnt == 0) && (*value == '?'))
             {
-                port_index = BT_COM_PORT_AUDIO;
+                uart_node = TRUE;
+                value ++;
+                value_len --;
             }
-            else if(strstr(split, "BTISOC"))
+            if((value_len == 0) || (value_len >= DEVICE_NODE_MAX_LEN))
             {
-                port_index = BT_COM_PORT_ISO;
+                return FALSE;
             }
-#endif
-            strcpy(skwbt_device_node[port_index], trim(split));
-            scomm_vendor_set_port_name(port_index, skwbt_device_node[port_index], mode);
-
-            port_index ++;
+            memcpy(conf->device_node[conf->node_cnt], value, value_len + 1);
+            conf->uart_node |= uart_node;
+            conf->node_cnt ++;
         }
-    }
-
-
-    fclose(fp);
-
-    skwbt_transtype = SKWBT_TRANS_TYPE_H4;
-    if(skwbt_device_node[0][0] == '?')
-    {
-        int i = 0;
-        while(skwbt_device_node[0][i] != '\0')
-        {
-            skwbt_device_node[0][i] = skwbt_device_node[0][i + 1];
-            i++;
-        }
-        scomm_vendor_set_port_name(0, skwbt_device_node[0], O_RDWR);
-        skwbt_transtype |= SKWBT_TRANS_TYPE_UART;
-    }
-}
-
-char skwbt_boot_open()
-{
-    btboot_fp = open("/dev/BTBOOT", O_RDWR);
-    if (btboot_fp < 0)
-    {
-        ALOGE("%s: unable to open : %s", __func__, strerror(errno));
-        return FALSE;
+        break;
     }
     return TRUE;
 }
 
-static void load_skwbt_stack_conf()
+static char skwbt_conf_parse(skwbt_conf_st *conf)
 {
     FILE *fp = fopen(SKWBT_CONFIG_FILE, "rt");
     if (!fp)
     {
         ALOGE("%s unable to open file '%s': %s", __func__, SKWBT_CONFIG_FILE, strerror(errno));
-        return;
+        return FALSE;
     }
-    char *split;
+
     int line_num = 0;
-    char line[1024];
+    char line[SKWBT_CONF_LINE_MAX];
     while (fgets(line, sizeof(line), fp))
     {
-        char *line_ptr = trim(line);
+        char *key = line, *key_end, *value, *value_end;
+        const skwbt_conf_key_st *entry;
+
         ++line_num;
+        while (isspace((unsigned char)*key))
+        {
+            ++key;
+        }
 
         // Skip blank and comment lines.
-        if (*line_ptr == '\0' || *line_ptr == '#' || *line_ptr == '[')
+        if (*key == '\0' || *key == '#' || *key == '[')
         {
             continue;
         }
 
-        split = strchr(line_ptr, '=');
-        if (!split)
+        value = strchr(key, '=');
+        if (!value)
         {
             ALOGE("%s no key/value separator found on line %d.", __func__, line_num);
             continue;
         }
 
-        *split = '\0';
-
-        if(!strcmp(trim(line_ptr), "SkwBtsnoopDump"))
+        key_end = value;
+        while ((key_end > key) && isspace((unsigned char)key_end[-1]))
         {
-            if(!strcmp(trim(split + 1), "true"))
-            {
-                btsnoop_log_en = TRUE;
-            }
-            else
-            {
-                btsnoop_log_en = FALSE;
-            }
+            --key_end;
         }
-        else if(!strcmp(trim(line_ptr), "BtSnoopFileName"))
+        ++value;
+        while (isspace((unsigned char)*value))
         {
-            sprintf(skw_btsnoop_path, "%s", trim(split + 1));
+            ++value;
         }
-        else if(!strcmp(trim(line_ptr), "BtSnoopSaveLog"))
+        value_end = value + strlen(value);
+        while ((value_end > value) && isspace((unsigned char)value_end[-1]))
         {
-            if(!strcmp(trim(split + 1), "true"))
-            {
-                btsnoop_save_log = TRUE;
-            }
-            else
-            {
-                btsnoop_save_log = FALSE;
-            }
+            --value_end;
         }
-        else if(!strcmp(trim(line_ptr), "SkwBtcplog"))
+        *value_end = '\0';
+
+        entry = skwbt_conf_find(key, key_end - key);
+        if (entry == NULL)
         {
-            if(!strcmp(trim(split + 1), "true"))
-            {
-                btcp_log_en = TRUE;
-            }
-            else
-            {
-                btcp_log_en = FALSE;
-            }
+            continue;//not ours, e.g. Name
         }
-        else if(!strcmp(trim(line_ptr), "SkwLogSlice"))
+        if ((value_end == value) || !skwbt_conf_set(conf, entry, value, value_end - value))
         {
-            if(!strcmp(trim(split + 1), "true"))
-            {
-                skwlog_slice = TRUE;
-            }
-            else
-            {
-                skwlog_slice = FALSE;
-            }
+            ALOGE("%s invalid value '%s' for %s on line %d, ignored", __func__, value, entry->key, line_num);
         }
-        else if(!strcmp(trim(line_ptr), "SkwBtDrvlog"))
+    }
+
+    fclose(fp);
+    return TRUE;
+}
+
+static void skwbt_conf_apply(const skwbt_conf_st *conf)
+{
+    for(uint8_t i = 0; i < conf->node_cnt; i++)
+    {
+        scomm_vendor_set_port_name(i, (char *)conf->device_node[i], O_RDWR);
+    }
+
+    skwbt_transtype = SKWBT_TRANS_TYPE_H4;
+    if(conf->uart_node)
+    {
+        skwbt_transtype |= SKWBT_TRANS_TYPE_UART;
+    }
+
+    btsnoop_log_en   = conf->snoop_dump;
+    btsnoop_save_log = conf->snoop_save_log;
+    if(conf->snoop_path[0] != '\0')
+    {
+        strcpy(skw_btsnoop_path, conf->snoop_path);
+    }
+    btsnoop_seg_size = conf->snoop_seg_size * 1024 * 1024;
+    btsnoop_seg_cnt  = conf->snoop_seg_cnt;
+    skw_nv_window    = conf->nv_window;
+    btcp_log_en      = conf->cp_log;
+    skwlog_slice     = conf->log_slice;
+    skwdriverlog_en  = conf->drv_log;
+    skwbtuartonly    = conf->uart_only;
+    skwbtNoSleep     = conf->no_sleep;
+
+    //the baud switch needs both the rate and the firmware's opcode
+    skw_uart_baud = 0;
+    skw_uart_baud_opcode = 0;
+    if((conf->uart_baud != 0) && (conf->uart_baud_opcode != 0))
+    {
+        uint8_t cfg_baud;
+        if(!scomm_vendor_baud_cfg(conf->uart_baud, &cfg_baud))
         {
-            if(!strcmp(trim(split + 1), "false"))
-            {
-                skwdriverlog_en = FALSE;
-            }
+            ALOGE("%s unsupported SkwUartBaudRate %d, ignored", __func__, conf->uart_baud);
         }
-        else if(!strcmp(trim(line_ptr), "SkwBtUartOnly"))
+        else if(HCI_OGF(conf->uart_baud_opcode) != HCI_OGF(HCI_GRP_VENDOR_SPECIFIC))
         {
-            if(!strcmp(trim(split + 1), "false"))//SkwBtUartOnly is false
-            {
-                skwbtuartonly = FALSE;
-            }
+            ALOGE("%s SkwUartBaudOpcode 0x%04X is not a vendor command, ignored", __func__, conf->uart_baud_opcode);
         }
-        else if(!strcmp(trim(line_ptr), "SkwBtNoSleep"))
+        else
         {
-            if(strcmp(trim(split + 1), "true") == 0)//SkwBtNoSleep is true
-            {
-                skwbtNoSleep = TRUE;
-            }
+            skw_uart_baud = conf->uart_baud;
+            skw_uart_baud_opcode = (uint16_t)conf->uart_baud_opcode;
         }
+    }
+    else if((conf->uart_baud != 0) || (conf->uart_baud_opcode != 0))
+    {
+        ALOGE("%s SkwUartBaudRate and SkwUartBaudOpcode are both needed, baud switch off", __func__);
+    }
+}
 
+/*
+ * skwbt.conf is parsed in a single pass; the result is kept and reused by
+ * later init() calls as long as the file size and mtime are unchanged
+ */
+static void load_skwbt_conf()
+{
+    struct stat st;
 
+    if(stat(SKWBT_CONFIG_FILE, &st) != 0)
+    {
+        ALOGE("%s unable to stat file '%s': %s", __func__, SKWBT_CONFIG_FILE, strerror(errno));
+        skwbt_conf_valid = FALSE;
+        return;
     }
 
-    fclose(fp);
+    if(!skwbt_conf_valid || (skwbt_conf_mtime != st.st_mtime) || (skwbt_conf_size != st.st_size))
+    {
+        skwbt_conf_defaults(&skwbt_conf);
+        if(!skwbt_conf_parse(&skwbt_conf))
+        {
+            skwbt_conf_valid = FALSE;
+            return;
+        }
+        skwbt_conf_valid = TRUE;
+        skwbt_conf_mtime = st.st_mtime;
+        skwbt_conf_size  = st.st_size;
+    }
+    else
+    {
+        ALOGD("%s reuse parsed %s", __func__, SKWBT_CONFIG_FILE);
+    }
+
+    skwbt_conf_apply(&skwbt_conf);
 }
 
+char skwbt_boot_open()
+{
+    btboot_fp = open("/dev/BTBOOT", O_RDWR);
+    if (btboot_fp < 0)
+    {
+        ALOGE("%s: unable to open : %s", __func__, strerror(errno));
+        return FALSE;
+    }
+    return TRUE;
+}
 
 
 
@@ -289,7 +416,6 @@ static int init(const bt_vendor_callbacks_t *p_cb, unsigned char *local_bdaddr)
     scomm_vendor_init();
 
     load_skwbt_conf();
-    load_skwbt_stack_conf();
     skwlog_init();
 
 
@@ -482,6 +608,7 @@ static void cleanup( void )
         skw_btsnoop_close();
     }
     skwlog_close();
+    skw_nv_free();
 
     btsnoop_log_en = FALSE;
     bt_vendor_cbacks = NULL;
@@ -23,7 +23,10 @@
 #include <sys/eventfd.h>
 #include <cutils/sockets.h>
 #include <sys/poll.h>
+#include <sys/uio.h>
 #include <assert.h>
+#include <time.h>
+#include <limits.h>
 #include "scom_vendor.h"
 #include "bt_hci_bdroid.h"
 #include "skw_common.h"
@@ -31,17 +34,29 @@
 #include "skw_btsnoop.h"
 #include "skw_log.h"
 #include "skw_gen_addr.h"
+#include "skw_ring.h"
+#include "skw_nv.h"
+#include "skw_stats.h"
 
 
 
 bt_hw_cfg_cb_st      hw_cfg_cb;
 scomm_vnd_st         scomm_vnd[BT_COM_PORT_SIZE];
 skw_socket_object_st skw_socket_object;
-uint8_t              recvSocketBuf[4096];
 static pthread_mutex_t write2host_lock;
+static skw_ring_st   host_fast_ring;    //SCO/ISO packets waiting for the host socket
+static uint64_t      host_fast_stamp[SKW_HOST_FAST_SLOTS];//arrival time of the fast lane packets
+static uint8_t       host_fast_port[SKW_HOST_FAST_SLOTS]; //and the port they came from
 uint16_t             chip_version = 0;
+uint8_t              skw_nv_window = 1;    //NVDS commands in flight, SkwNvWindow in skwbt.conf, up to NV_PIPELINE_WINDOW_MAX
+uint32_t             skw_uart_baud = 0;    //UART rate after reset, 0:keep the open rate, SkwUartBaudRate in skwbt.conf
+uint16_t             skw_uart_baud_opcode = 0;//vendor command setting the rate, SkwUartBaudOpcode in skwbt.conf
 #define SKWBT_NV_FILE_PATH       "/vendor/etc/bluetooth"
 
+extern char btsnoop_log_en;
+extern char btcp_log_en;
+extern char skw_btsnoop_path[];
+
 
 static const uint8_t hci_preamble_sizes[] =
 {
@@ -66,47 +81,68 @@ static tUSERIAL_CFG userial_H4_cfg =
 };
 
 
+static const char hex_digits[] = "0123456789ABCDEF";
+
 char hex2char(int num)
 {
-    char ch;
-    if(num >= 0 && num <= 9)
-    {
-        ch = num + 48;
-    }
-    else if(num > 9 && num <= 15)
+    if(num >= 0 && num <= 15)
     {
-        ch = (num - 10) + 65;
+        return hex_digits[num];
     }
-    else
-    {
-        ch = '\0';
-    }
-    return ch;
+    return '\0';
 }
 
 void hex2String(unsigned char hex[], unsigned char str[], int N)
 {
-    int i = 0, j;
-    for(i = 0, j = 0; i < N; i++, j += 2)
+    for(int i = 0; i < N; i++)
     {
-        str[j] = hex2char((hex[i] & 0xF0) >> 4);
-        str[j + 1] = hex2char(hex[i] & 0x0F);
+        *str++ = hex_digits[hex[i] >> 4];
+        *str++ = hex_digits[hex[i] & 0x0F];
     }
-    str[N << 1] = 0;
+    *str = 0;
 }
 
 
+static uint64_t scomm_vendor_now_us()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
 void scomm_vendor_init()
 {
+    pthread_condattr_t cond_attr;
+    pthread_condattr_init(&cond_attr);
+    pthread_condattr_setclock(&cond_attr, CLOCK_MONOTONIC);
+
     for(uint8_t i = 0; i < BT_COM_PORT_SIZE; i++)
     {
         memset(&scomm_vnd[i], 0, sizeof(scomm_vnd_st));
         scomm_vnd[i].fd           = -1;
         scomm_vnd[i].driver_state = FALSE;
         scomm_vnd[i].mode         = O_RDWR;
+        pthread_mutex_init(&scomm_vnd[i].state_lock, NULL);
+        pthread_cond_init(&scomm_vnd[i].state_cond, &cond_attr);
     }
+    pthread_condattr_destroy(&cond_attr);
 
     pthread_mutex_init(&write2host_lock, NULL);
+    skw_stats_reset();
+
+    if(host_fast_ring.buffer == NULL)
+    {
+        skw_ring_init(&host_fast_ring, SKW_HOST_FAST_SLOTS, SKW_HOST_FAST_PKT_LEN);
+    }
+    else
+    {
+        //drop what is left from the last session
+        uint32_t pos, len;
+        while(skw_ring_claim(&host_fast_ring, &pos, &len) != NULL)
+        {
+            skw_ring_release(&host_fast_ring, pos);
+        }
+    }
 }
 
 void scomm_vendor_set_port_name(uint8_t port_index, char *port_name, int mode)
@@ -197,6 +233,53 @@ uint8_t scomm_vendor_tcio_baud(uint8_t cfg_baud, uint32_t *baud)
     return TRUE;
 }
 
+/*******************************************************************************
+**
+** Function        scomm_vendor_baud_cfg
+**
+** Description     helper function converts a baud rate in bps into the
+**                  USERIAL baud rate index
+**
+** Returns         TRUE/FALSE
+**
+*******************************************************************************/
+uint8_t scomm_vendor_baud_cfg(uint32_t rate, uint8_t *cfg_baud)
+{
+    switch(rate)
+    {
+        case 115200:
+            *cfg_baud = USERIAL_BAUD_115200;
+            break;
+        case 230400:
+            *cfg_baud = USERIAL_BAUD_230400;
+            break;
+        case 460800:
+            *cfg_baud = USERIAL_BAUD_460800;
+            break;
+        case 921600:
+            *cfg_baud = USERIAL_BAUD_921600;
+            break;
+        case 1000000:
+            *cfg_baud = USERIAL_BAUD_1M;
+            break;
+        case 1500000:
+            *cfg_baud = USERIAL_BAUD_1_5M;
+            break;
+        case 2000000:
+            *cfg_baud = USERIAL_BAUD_2M;
+            break;
+        case 3000000:
+            *cfg_baud = USERIAL_BAUD_3M;
+            break;
+        case 4000000:
+            *cfg_baud = USERIAL_BAUD_4M;
+            break;
+        default:
+            return FALSE;
+    }
+    return TRUE;
+}
+
 
 /*******************************************************************************
 **
@@ -322,6 +405,35 @@ int scomm_vendor_uart_open(uint8_t port_index)
 
 }
 
+/*******************************************************************************
+**
+** Function        scomm_vendor_uart_set_baud
+**
+** Description     switch the termios speed of an opened UART, the controller
+**                  must have been told to use the new rate already
+**
+** Returns         TRUE/FALSE
+**
+*******************************************************************************/
+static uint8_t scomm_vendor_uart_set_baud(uint8_t port_index, uint8_t cfg_baud)
+{
+    uint32_t baud;
+
+    if((scomm_vnd[port_index].fd < 0) || !scomm_vendor_tcio_baud(cfg_baud, &baud))
+    {
+        return FALSE;
+    }
+
+    cfsetospeed(&scomm_vnd[port_index].termios, baud);
+    cfsetispeed(&scomm_vnd[port_index].termios, baud);
+    if(tcsetattr(scomm_vnd[port_index].fd, TCSANOW, &scomm_vnd[port_index].termios) != 0)
+    {
+        ALOGE("%s tcsetattr fail: %s", __func__, strerror(errno));
+        return FALSE;
+    }
+    return TRUE;
+}
+
 
 /*******************************************************************************
 **
@@ -367,167 +479,463 @@ int scomm_vendor_usbsdio_open(uint8_t port_index)
 
 /*******************************************************************************
 **
-** Function        scomm_vendor_recv_rawdata
+** Function        scomm_vendor_get_pkt_len
 **
-** Description     recv data from host and process
+** Description     get the total length of the H4 packet at the head of buffer
 **
-** Returns         None
+** Returns         packet length include the type byte, 0 if header is not complete
 **
 *******************************************************************************/
-uint8_t pkt_cnts = 0;
-static void scomm_vendor_recv_rawdata(void *context)
+static uint32_t scomm_vendor_get_pkt_len(const uint8_t *buffer, uint16_t len)
 {
-    SKW_UNUSED(context);
-    uint8_t port_index = 0;//(uint8_t)context;
-    ssize_t  bytes_read = 0;
-    uint8_t  pkt_type = 0, offset = 1;
-    uint16_t need_read_lens = 0, total_len = 0;
-    int16_t  rev_len = 0;
+    uint8_t  pkt_type = buffer[0];
+    uint32_t hdr_lens = hci_preamble_sizes[pkt_type] + 1;
+    uint32_t pkt_len  = 0;
 
-    //SKWBT_LOG("%s [%d] start", __func__, port_index);
+    if(len < hdr_lens)
+    {
+        return 0;
+    }
 
-    //do{
+    switch(pkt_type)
+    {
+        case HCI_ACLDATA_PKT:
+        case HCI_ISO_PKT:
+            pkt_len = buffer[HCI_COMMON_DATA_LENGTH_INDEX] | (buffer[HCI_COMMON_DATA_LENGTH_INDEX + 1] << 8);
+            break;
+        case HCI_EVENT_PKT:
+            pkt_len = buffer[HCI_EVENT_DATA_LENGTH_INDEX];
+            break;
+        case HCI_EVENT_SKWLOG:
+            pkt_len = buffer[HCI_SKWLOG_DATA_LENGTH_INDEX] | (buffer[HCI_SKWLOG_DATA_LENGTH_INDEX + 1] << 8);
+            break;
+        default://cmd/sco
+            pkt_len = buffer[HCI_COMMON_DATA_LENGTH_INDEX];
+            break;
+    }
+    return pkt_len + hdr_lens;
+}
 
-    //-----------type-------------//
-    //do
+/*******************************************************************************
+**
+** Function        scomm_vendor_reasm_compact
+**
+** Description     release the consumed bytes of the reassembly buffer, the
+**                 remaining data is only moved to the front when the pending
+**                 packet(pkt_len, 0 if unknown) would not fit behind it
+**
+** Returns         None
+**
+*******************************************************************************/
+static void scomm_vendor_reasm_compact(skw_h4_reasm_st *reasm, uint32_t pkt_len)
+{
+    if(reasm->head == reasm->tail)
     {
-        rev_len = read(scomm_vnd[port_index].uart_fd[1], recvSocketBuf, 1);
-        if(rev_len <= 0)
-        {
-            ALOGE("%s type read err, rev_len:%d", __func__, rev_len);
-            return ;
-        }
-        bytes_read += rev_len;
+        reasm->head = 0;
+        reasm->tail = 0;
+        return ;
     }
-    //while (bytes_read < 1);
 
-    total_len = 1;
-    pkt_type = recvSocketBuf[0];
-    if((pkt_type == HCI_COMMAND_PKT) || (pkt_type == HCI_ACLDATA_PKT) || (pkt_type == HCI_SCODATA_PKT) || (pkt_type == HCI_ISO_PKT))
+    if(pkt_len == 0)
     {
-        need_read_lens = hci_preamble_sizes[pkt_type];
+        pkt_len = HCI_ISODATA_PKT_PREAMBLE_SIZE + 1;
     }
-    else
+    if(pkt_len > SKW_H4_REASM_BUFFER_SIZE)
     {
-        ALOGE("%s invalid data type: %d", __func__, pkt_type);
-        assert(0);
+        ALOGE("%s packet too long, pkt_len:%u", __func__, pkt_len);
+        reasm->head = 0;
+        reasm->tail = 0;
+        return ;
     }
-    offset += need_read_lens;
+    if((reasm->head + pkt_len) > SKW_H4_REASM_BUFFER_SIZE)
+    {
+        reasm->tail -= reasm->head;
+        memmove(reasm->buffer, reasm->buffer + reasm->head, reasm->tail);
+        reasm->head = 0;
+    }
+}
 
-    //SKWBT_LOG("pkt_type:%d, bytes_read:%zd, offset:%d", pkt_type, bytes_read, offset);
+/*******************************************************************************
+**
+** Function        scomm_vendor_get_send_port
+**
+** Description     pick the device node a host packet is written to
+**
+** Returns         port index
+**
+*******************************************************************************/
+static uint8_t scomm_vendor_get_send_port(uint8_t pkt_type)
+{
+    if(skwbt_transtype & SKWBT_TRANS_TYPE_SDIO)
+    {
+        switch(pkt_type)
+        {
+            case HCI_ACLDATA_PKT:
+                return BT_COM_PORT_ACL;
+            case HCI_SCODATA_PKT:
+                return BT_COM_PORT_AUDIO;
+            case HCI_ISO_PKT:
+                return BT_COM_PORT_ISO;
+            default:
+                break;
+        }
+    }
+    return BT_COM_PORT_CMDEVT;
+}
 
-    //-----------header-------------//
-    bytes_read = 0;
-    offset = 1;
-    do
+/*******************************************************************************
+**
+** Function        scomm_vendor_send_to_controller
+**
+** Description     write a host packet to the non-blocking device node of port,
+**                 *offset holds the bytes of the packet already written
+**
+** Returns         FALSE if the node is full and the rest must wait for EPOLLOUT
+**
+*******************************************************************************/
+uint8_t pkt_cnts = 0;
+static char scomm_vendor_send_to_controller(uint8_t send_port, uint8_t *buffer, uint32_t total_len, uint32_t *offset)
+{
+    if((*offset == 0) && (skwbt_transtype & SKWBT_TRANS_TYPE_UART) && (skwbtuartonly == FALSE) && (skwbtNoSleep == FALSE) && (btpw_fp > 0))//uart
     {
-        rev_len = read(scomm_vnd[port_index].uart_fd[1], recvSocketBuf + offset + bytes_read, need_read_lens);
-        if(rev_len < 0)
+        char tmp_buf[6] = {0};
+        int r_len;
+
+        tmp_buf[0] = pkt_cnts ++;
+        r_len = write(btpw_fp, tmp_buf, 1);
+        SKWBT_LOG("r_len:%d, btpw_fp:%d, pkt_cnts:%d", r_len, btpw_fp, pkt_cnts);
+    }
+
+    while((*offset < total_len) && scomm_vnd[send_port].driver_state)
+    {
+        ssize_t ret;
+        RW_NO_INTR(ret = write(scomm_vnd[send_port].fd, buffer + *offset, total_len - *offset));
+
+        if(ret > 0)
         {
-            ALOGE("%s header read err, rev_len:%d", __func__, rev_len);
-            return ;
+            *offset += ret;
+        }
+        else if((ret == 0) || (errno == EAGAIN) || (errno == EWOULDBLOCK))
+        {
+            skw_stats_inc(send_port, SKW_STATS_WRITE_RETRIES, 1);
+            return FALSE;
+        }
+        else
+        {
+            ALOGE("In %s, error writing to the scomm: %s", __func__, strerror(errno));
+            break;//the packet is lost
         }
-        bytes_read += rev_len;
-        //SKWBT_LOG("header bytes_read:%zd, need_read_lens:%d", bytes_read, need_read_lens);
-    } while (bytes_read < need_read_lens);
-    offset += need_read_lens;
+    }
+    return TRUE;
+}
 
-    total_len += need_read_lens;
-    //get payload length
-    if((pkt_type == HCI_ACLDATA_PKT) || (pkt_type == HCI_ISO_PKT))
+/*******************************************************************************
+**
+** Function        scomm_vendor_tx_arm
+**
+** Description     watch(or stop watching) the device node of port for EPOLLOUT
+**
+** Returns         None
+**
+*******************************************************************************/
+static void scomm_vendor_tx_arm(uint8_t port_index, char arm)
+{
+    skw_tx_ctx_st *tx = &scomm_vnd[port_index].tx;
+    struct epoll_event event;
+
+    if(tx->armed == arm)
     {
-        need_read_lens = *(uint16_t *)&recvSocketBuf[HCI_COMMON_DATA_LENGTH_INDEX];
+        return;
     }
-    else if((pkt_type == HCI_EVENT_PKT) || (pkt_type == HCI_EVENT_SKWLOG))
+
+    memset(&event, 0, sizeof(event));
+    event.events   = EPOLLOUT;
+    event.data.ptr = (void *)&tx->object;
+    if(epoll_ctl(scomm_vnd[0].epoll_fd, arm ? EPOLL_CTL_ADD : EPOLL_CTL_DEL, scomm_vnd[port_index].fd, &event) == -1)
     {
-        need_read_lens = recvSocketBuf[HCI_EVENT_DATA_LENGTH_INDEX];
+        ALOGE("%s [%d] arm:%d fail: %s", __func__, port_index, arm, strerror(errno));
+        return;
     }
-    else//cmd/sco
+    tx->armed = arm;
+}
+
+/*******************************************************************************
+**
+** Function        scomm_vendor_host_pause
+**
+** Description     stop(or restart) reading the host socket while a TX queue
+**                 is full, the pending data stays in host_rx
+**
+** Returns         None
+**
+*******************************************************************************/
+static char host_rx_paused = FALSE;
+static uint64_t host_rx_us = 0;//arrival time of the latest host data
+static void scomm_vendor_host_pause(char pause)
+{
+    struct epoll_event event;
+
+    if(host_rx_paused == pause)
     {
-        need_read_lens = recvSocketBuf[HCI_COMMON_DATA_LENGTH_INDEX];
+        return;
     }
-    //-----------payload-------------//
-    bytes_read = 0;
-    if(need_read_lens > 0)
+
+    memset(&event, 0, sizeof(event));
+    event.events   = pause ? 0 : (EPOLLIN | EPOLLHUP | EPOLLRDHUP | EPOLLERR);
+    event.data.ptr = (void *)&skw_socket_object;
+    if(epoll_ctl(scomm_vnd[0].epoll_fd, EPOLL_CTL_MOD, scomm_vnd[0].uart_fd[1], &event) == -1)
     {
-        do
+        ALOGE("%s pause:%d fail: %s", __func__, pause, strerror(errno));
+        return;
+    }
+    host_rx_paused = pause;
+}
+
+static void scomm_vendor_host_parse(skw_h4_reasm_st *reasm);
+
+/*******************************************************************************
+**
+** Function        scomm_vendor_tx_drain
+**
+** Description     EPOLLOUT handler of a device node, write out its TX queue
+**                 until the node is full again or the queue is empty
+**
+** Returns         None
+**
+*******************************************************************************/
+static void scomm_vendor_tx_drain(void *context)
+{
+    uint8_t port_index = (uint8_t)(long)context;
+    skw_tx_ctx_st *tx = &scomm_vnd[port_index].tx;
+
+    while(1)
+    {
+        if(tx->cur_data == NULL)
         {
-            rev_len = read(scomm_vnd[port_index].uart_fd[1], recvSocketBuf + offset + bytes_read, need_read_lens);
-            if(rev_len < 0)
+            tx->cur_data = skw_ring_claim(&tx->ring, &tx->cur_pos, &tx->cur_len);
+            tx->offset = 0;
+            if(tx->cur_data == NULL)
             {
-                ALOGE("%s header read err, rev_len:%d", __func__, rev_len);
-                return ;
+                scomm_vendor_tx_arm(port_index, FALSE);
+                break;
             }
-            bytes_read += rev_len;
-            //SKWBT_LOG("payload bytes_read:%zd, need_read_lens:%d", bytes_read, need_read_lens);
-        } while (bytes_read < need_read_lens);
-        total_len += need_read_lens;
+        }
+        if(!scomm_vendor_send_to_controller(port_index, tx->cur_data, tx->cur_len, &tx->offset))
+        {
+            return;
+        }
+        skw_stats_lat(port_index, SKW_STATS_H2C, 1, tx->stamp_us[tx->cur_pos & (SKW_TX_RING_SLOTS - 1)], scomm_vendor_now_us());
+        skw_ring_release(&tx->ring, tx->cur_pos);
+        tx->cur_data = NULL;
     }
 
+    //there is room again, push on the host data that was held back
+    if(host_rx_paused)
+    {
+        scomm_vendor_host_pause(FALSE);
+        scomm_vendor_host_parse(&scomm_vnd[0].host_rx);
+    }
+}
 
-    uint8_t str_buffer[2056] = {0};
-    hex2String(recvSocketBuf, str_buffer, (total_len > 64) ? 64 : total_len);
+/*******************************************************************************
+**
+** Function        scomm_vendor_tx_start
+**
+** Description     set up the TX queue of a port, the device node is switched
+**                 to non-blocking mode
+**
+** Returns         TRUE/FALSE
+**
+*******************************************************************************/
+static char scomm_vendor_tx_start(uint8_t port_index)
+{
+    skw_tx_ctx_st *tx = &scomm_vnd[port_index].tx;
+    int flags = fcntl(scomm_vnd[port_index].fd, F_GETFL);
 
-    if((skwbt_transtype & SKWBT_TRANS_TYPE_UART) && (skwbtuartonly == FALSE) && (skwbtNoSleep == FALSE) && (btpw_fp > 0))//uart
+    if((flags == -1) || (fcntl(scomm_vnd[port_index].fd, F_SETFL, flags | O_NONBLOCK) == -1))
     {
-        char tmp_buf[6] = {0};
-        int r_len;
+        ALOGE("%s [%d] set O_NONBLOCK fail: %s", __func__, port_index, strerror(errno));
+        return FALSE;
+    }
+    if(!skw_ring_init(&tx->ring, SKW_TX_RING_SLOTS, SKW_TX_PKT_LEN))
+    {
+        return FALSE;
+    }
 
-        tmp_buf[0] = pkt_cnts ++;
-        r_len = write(btpw_fp, tmp_buf, 1);
-        SKWBT_LOG("r_len:%d, btpw_fp:%d, pkt_cnts:%d", r_len, btpw_fp, pkt_cnts);
+    tx->cur_data = NULL;
+    tx->armed    = FALSE;
+    tx->object.fd          = scomm_vnd[port_index].fd;
+    tx->object.context     = (void *)(long)port_index;
+    tx->object.read_ready  = NULL;
+    tx->object.write_ready = scomm_vendor_tx_drain;
+    return TRUE;
+}
+
+/*******************************************************************************
+**
+** Function        scomm_vendor_tx_free
+**
+** Description     release the TX queue of a port, only after the host reader
+**                 thread is gone, queued packets are lost
+**
+** Returns         None
+**
+*******************************************************************************/
+static void scomm_vendor_tx_free(uint8_t port_index)
+{
+    skw_tx_ctx_st *tx = &scomm_vnd[port_index].tx;
+
+    if(tx->ring.buffer == NULL)
+    {
+        return;
     }
+    tx->cur_data = NULL;
+    tx->armed    = FALSE;
+    skw_ring_deinit(&tx->ring);
+}
 
-    uint16_t length = total_len;
-    uint16_t transmitted_length = 0;
-    uint8_t  send_port = BT_COM_PORT_CMDEVT;
-    if(skwbt_transtype & SKWBT_TRANS_TYPE_SDIO)
+/*******************************************************************************
+**
+** Function        scomm_vendor_tx_queue
+**
+** Description     send a host packet to its port at once if nothing is queued
+**                 before it, otherwise(or for the unwritten rest) queue it
+**                 and wait for EPOLLOUT
+**
+** Returns         FALSE if the TX queue is full and the packet must be retried
+**
+*******************************************************************************/
+static char scomm_vendor_tx_queue(uint8_t send_port, uint8_t *buffer, uint32_t length)
+{
+    skw_tx_ctx_st *tx = &scomm_vnd[send_port].tx;
+    uint32_t offset = 0;
+    uint32_t pos;
+    uint8_t *data;
+
+    if((tx->ring.buffer == NULL) || !scomm_vnd[send_port].driver_state)
     {
-        switch(recvSocketBuf[0])
+        ALOGE("%s port:%d is not open, drop len:%u", __func__, send_port, length);
+        return TRUE;
+    }
+
+    //checked before any byte goes out, a partly written packet can not be dropped
+    if(length > SKW_TX_PKT_LEN)
+    {
+        ALOGE("%s port:%d packet too long, drop len:%u", __func__, send_port, length);
+        return TRUE;
+    }
+
+    if((tx->cur_data == NULL) && skw_ring_is_empty(&tx->ring))
+    {
+        if(scomm_vendor_send_to_controller(send_port, buffer, length, &offset))
         {
-            case HCI_ACLDATA_PKT:
-                send_port = BT_COM_PORT_ACL;
-                break;
-            case HCI_SCODATA_PKT:
-                send_port = BT_COM_PORT_AUDIO;
-                break;
-            case HCI_ISO_PKT:
-                send_port = BT_COM_PORT_ISO;
-                break;
-            default:
-                send_port = BT_COM_PORT_CMDEVT;
-                break;
+            skw_stats_lat(send_port, SKW_STATS_H2C, 1, host_rx_us, scomm_vendor_now_us());
+            return TRUE;
         }
     }
 
+    data = skw_ring_try_reserve(&tx->ring, &pos);
+    if(data == NULL)
+    {
+        return FALSE;
+    }
+    memcpy(data, buffer, length);
+    tx->stamp_us[pos & (SKW_TX_RING_SLOTS - 1)] = host_rx_us;
+    skw_ring_commit(&tx->ring, pos, length);
 
-    SKWBT_LOG("total_len:%d, port:%d, %s", total_len, send_port, str_buffer);
+    if(offset > 0)//partly written, it is the head of the queue now
+    {
+        tx->cur_data = skw_ring_claim(&tx->ring, &tx->cur_pos, &tx->cur_len);
+        tx->offset   = offset;
+    }
+    scomm_vendor_tx_arm(send_port, TRUE);
+    return TRUE;
+}
 
-    skw_btsnoop_capture(recvSocketBuf, FALSE);
+/*******************************************************************************
+**
+** Function        scomm_vendor_host_parse
+**
+** Description     cut the complete packets out of the host data and queue
+**                 them to the port they go to, stop at a full TX queue
+**
+** Returns         None
+**
+*******************************************************************************/
+static void scomm_vendor_host_parse(skw_h4_reasm_st *reasm)
+{
+    uint32_t pkt_len = 0;
 
+    while(reasm->head < reasm->tail)
+    {
+        uint8_t *pkt_ptr = reasm->buffer + reasm->head;
+        uint8_t  pkt_type = pkt_ptr[0];
+        if((pkt_type != HCI_COMMAND_PKT) && (pkt_type != HCI_ACLDATA_PKT) && (pkt_type != HCI_SCODATA_PKT) && (pkt_type != HCI_ISO_PKT))
+        {
+            ALOGE("%s invalid data type: %d", __func__, pkt_type);
+            skw_stats_inc(BT_COM_PORT_CMDEVT, SKW_STATS_DISCARDS, reasm->tail - reasm->head);
+            reasm->head = 0;
+            reasm->tail = 0;
+            assert(0);
+            return ;
+        }
 
+        pkt_len = scomm_vendor_get_pkt_len(pkt_ptr, reasm->tail - reasm->head);
+        if((pkt_len == 0) || (pkt_len > (uint32_t)(reasm->tail - reasm->head)))
+        {
+            break;//need more
+        }
 
-    while((length > 0) && scomm_vnd[send_port].driver_state)
-    {
-        ssize_t ret = write(scomm_vnd[send_port].fd, recvSocketBuf + transmitted_length, length);
+        uint8_t send_port = scomm_vendor_get_send_port(pkt_type);
+        if(!scomm_vendor_tx_queue(send_port, pkt_ptr, pkt_len))
+        {
+            SKWBT_LOG("port:%d TX queue full, hold host data", send_port);
+            scomm_vendor_host_pause(TRUE);
+            break;
+        }
 
-        switch (ret)
+        if(skwdriverlog_en)
         {
-            case -1:
-                ALOGE("In %s, error writing to the scomm: %s", __func__, strerror(errno));
-                return ;
-            //break;
-            case 0:
-                ALOGE("%s, ret %zd", __func__, ret);
-                break;
-            default:
-                transmitted_length += ret;
-                length -= ret;
-                //break;
+            uint8_t str_buffer[SKWBT_LOG_HEX_MAX * 2 + 1];
+            hex2String(pkt_ptr, str_buffer, (pkt_len > SKWBT_LOG_HEX_MAX) ? SKWBT_LOG_HEX_MAX : pkt_len);
+            SKWBT_LOG("total_len:%d, port:%d, %s", pkt_len, send_port, str_buffer);
         }
+        skw_stats_pkt(send_port, SKW_STATS_H2C, pkt_type, pkt_len);
+        skw_btsnoop_capture(pkt_ptr, FALSE);
+        reasm->head += pkt_len;
+        pkt_len = 0;
     }
 
-    SKWBT_LOG("%s [%d] end", __func__, port_index);
+    scomm_vendor_reasm_compact(reasm, pkt_len);
+}
+
+/*******************************************************************************
+**
+** Function        scomm_vendor_recv_rawdata
+**
+** Description     recv data from host and process, read as much as available
+**                 and queue every complete packet to the port it goes to
+**
+** Returns         None
+**
+*******************************************************************************/
+static void scomm_vendor_recv_rawdata(void *context)
+{
+    SKW_UNUSED(context);
+    uint8_t port_index = 0;//(uint8_t)context;
+    skw_h4_reasm_st *reasm = &scomm_vnd[port_index].host_rx;
+    ssize_t  rev_len = 0;
+
+    RW_NO_INTR(rev_len = read(scomm_vnd[port_index].uart_fd[1], reasm->buffer + reasm->tail, SKW_H4_REASM_BUFFER_SIZE - reasm->tail));
+    if(rev_len <= 0)
+    {
+        ALOGE("%s read err, rev_len:%zd", __func__, rev_len);
+        return ;
+    }
+    reasm->tail += rev_len;
+    host_rx_us = scomm_vendor_now_us();
+
+    scomm_vendor_host_parse(reasm);
 }
 
 static void *scomm_vendor_recv_socket_thread(void *arg)
@@ -567,119 +975,495 @@ static void *scomm_vendor_recv_socket_thread(void *arg)
                     object->read_ready(object->context);
                     //object->read_ready(port_index);
                 }
-                if (events[j].events & EPOLLOUT && object->write_ready)
+                //a device node only has write_ready, its errors end up there as well
+                if ((events[j].events & EPOLLOUT || ((events[j].events & (EPOLLHUP | EPOLLERR)) && !object->read_ready)) && object->write_ready)
+                {
+                    object->write_ready(object->context);
+                    //object->read_ready(port_index);
+                }
+            }
+        }
+    }
+
+    ALOGD("%s [%d] exit", __func__, port_index);
+    return NULL;
+}
+
+
+/*******************************************************************************
+**
+** Function        scomm_vendor_host_writev
+**
+** Description     one writev() to the host socket, the iovecs are advanced
+**                 past the written bytes, write2host_lock must be held
+**
+** Returns         TRUE if the first remaining packet is only partly written
+**
+*******************************************************************************/
+static char scomm_vendor_host_writev(struct iovec **iov, int *iov_cnt)
+{
+    ssize_t ret;
+
+    RW_NO_INTR(ret = writev(scomm_vnd[0].uart_fd[1], *iov, *iov_cnt));
+    SKWBT_LOG("write to host ret:%zd", ret);
+    if(ret < 0)
+    {
+        ALOGE("In %s, error writing to socket: %s", __func__, strerror(errno));
+        return FALSE;
+    }
+
+    //skip the iovecs already written, and adjust the partial one
+    while((*iov_cnt > 0) && ((size_t)ret >= (*iov)->iov_len))
+    {
+        ret -= (*iov)->iov_len;
+        (*iov) ++;
+        (*iov_cnt) --;
+    }
+    if((*iov_cnt > 0) && (ret > 0))
+    {
+        (*iov)->iov_base = (uint8_t *)(*iov)->iov_base + ret;
+        (*iov)->iov_len -= ret;
+        skw_stats_inc(BT_COM_PORT_CMDEVT, SKW_STATS_HOST_RETRIES, 1);
+        return TRUE;
+    }
+    return FALSE;
+}
+
+/*******************************************************************************
+**
+** Function        scomm_vendor_host_fast_drain
+**
+** Description     send all the queued SCO/ISO packets to host, called by the
+**                 owner of write2host_lock at packet boundaries only
+**
+** Returns         None
+**
+*******************************************************************************/
+static void scomm_vendor_host_fast_drain()
+{
+    uint32_t pos[SKW_HOST_IOV_MAX];
+    uint32_t lens[SKW_HOST_IOV_MAX];
+    struct iovec iov[SKW_HOST_IOV_MAX];
+    uint8_t *data;
+
+    while(1)
+    {
+        int cnt = 0;
+        while((cnt < SKW_HOST_IOV_MAX) && ((data = skw_ring_claim(&host_fast_ring, &pos[cnt], &lens[cnt])) != NULL))
+        {
+            iov[cnt].iov_base = data;
+            iov[cnt].iov_len  = lens[cnt];
+            cnt ++;
+        }
+        if(cnt == 0)
+        {
+            return;
+        }
+
+        struct iovec *p_iov = iov;
+        int iov_cnt = cnt;
+        while((iov_cnt > 0) && scomm_vnd[0].thread_running)
+        {
+            scomm_vendor_host_writev(&p_iov, &iov_cnt);
+        }
+        uint64_t now_us = scomm_vendor_now_us();
+        for(int i = 0; i < cnt; i++)
+        {
+            uint32_t idx = pos[i] & (SKW_HOST_FAST_SLOTS - 1);
+            skw_stats_lat(host_fast_port[idx], SKW_STATS_C2H, 1, host_fast_stamp[idx], now_us);
+            skw_ring_release(&host_fast_ring, pos[i]);
+        }
+    }
+}
+
+/*******************************************************************************
+**
+** Function        scomm_vendor_host_unlock
+**
+** Description     release write2host_lock, and take it back to flush the fast
+**                 lane if a SCO/ISO packet was queued while it was held
+**
+** Returns         None
+**
+*******************************************************************************/
+static void scomm_vendor_host_unlock()
+{
+    pthread_mutex_unlock(&write2host_lock);
+    while(!skw_ring_is_empty(&host_fast_ring) && (pthread_mutex_trylock(&write2host_lock) == 0))
+    {
+        scomm_vendor_host_fast_drain();
+        pthread_mutex_unlock(&write2host_lock);
+    }
+}
+
+/*******************************************************************************
+**
+** Function        scomm_vendor_send_iov_to_host
+**
+** Description     send a batch of packets to host with one writev(), the
+**                 lock is taken once for the whole batch. Queued SCO/ISO
+**                 packets go first and again at every packet boundary
+**
+** Returns         None
+**
+*******************************************************************************/
+static void scomm_vendor_send_iov_to_host(uint8_t port_index, struct iovec *iov, int iov_cnt)
+{
+    unsigned int total_length = 0;
+
+    for(int i = 0; i < iov_cnt; i++)
+    {
+        total_length += iov[i].iov_len;
+    }
+
+    pthread_mutex_lock(&write2host_lock);
+    while ((iov_cnt > 0) && scomm_vnd[port_index].thread_running)
+    {
+        scomm_vendor_host_fast_drain();
+        if(scomm_vendor_host_writev(&iov, &iov_cnt))
+        {
+            //never cut into a packet, finish the partial one first
+            struct iovec *p_iov = iov;
+            int cnt = 1;
+            while((cnt > 0) && scomm_vnd[port_index].thread_running)
+            {
+                scomm_vendor_host_writev(&p_iov, &cnt);
+            }
+            if(cnt == 0)
+            {
+                iov ++;
+                iov_cnt --;
+            }
+        }
+    }
+    scomm_vendor_host_fast_drain();
+    scomm_vendor_host_unlock();
+
+    SKWBT_LOG("write to host[%d] total_length:%d", port_index, total_length);
+}
+
+/*******************************************************************************
+**
+** Function        scomm_vendor_send_fast_to_host
+**
+** Description     queue a SCO/ISO packet on the fast lane, it is sent by this
+**                 thread if the host socket is free, otherwise by the current
+**                 owner before its next packet
+**
+** Returns         FALSE if the packet does not fit the fast lane
+**
+*******************************************************************************/
+static char scomm_vendor_send_fast_to_host(uint8_t port_index, uint8_t *buffer, uint32_t length, uint64_t rx_us)
+{
+    uint32_t pos;
+    uint8_t *data;
+
+    if((length > SKW_HOST_FAST_PKT_LEN) || (host_fast_ring.buffer == NULL))
+    {
+        return FALSE;
+    }
+
+    //stale audio is worth less than the newest frame, drop the oldest
+    data = skw_ring_reserve_evict(&host_fast_ring, &pos);
+    if(data != NULL)
+    {
+        memcpy(data, buffer, length);
+        host_fast_stamp[pos & (SKW_HOST_FAST_SLOTS - 1)] = rx_us;
+        host_fast_port[pos & (SKW_HOST_FAST_SLOTS - 1)]  = port_index;
+        skw_ring_commit(&host_fast_ring, pos, length);
+    }
+
+    if(pthread_mutex_trylock(&write2host_lock) == 0)
+    {
+        scomm_vendor_host_fast_drain();
+        scomm_vendor_host_unlock();
+    }
+    return TRUE;
+}
+
+/*******************************************************************************
+**
+** Function        scomm_vendor_send_to_host
+**
+** Description     send data to host
+**
+** Returns         None
+**
+*******************************************************************************/
+static void scomm_vendor_send_to_host(uint8_t port_index, unsigned char *buffer, unsigned int total_length)
+{
+    struct iovec iov;
+
+    iov.iov_base = buffer;
+    iov.iov_len  = total_length;
+    scomm_vendor_send_iov_to_host(port_index, &iov, 1);
+}
+
+
+/*******************************************************************************
+**
+** Function        scomm_vendor_send_hw_error
+**
+** Description     send HCI_HW_ERR command to hsot
+**
+** Returns         None
+**
+*******************************************************************************/
+
+void scomm_vendor_send_hw_error()
+{
+    unsigned char p_buf[10];
+
+    ALOGE("%s, CP Error", __func__);
+
+    p_buf[0] = HCI_EVENT_PKT;//event
+    p_buf[1] = HCI_HARDWARE_ERROR_EVENT;//hardware error
+    p_buf[2] = 0x01;//len
+    p_buf[3] = HWERR_CODE_CP_ERROR;//userial error code
+    scomm_vendor_send_to_host(0, p_buf, 4);
+}
+
+static const uint8_t c2h_pkt_types[] = {HCI_EVENT_PKT, HCI_ACLDATA_PKT, HCI_SCODATA_PKT, HCI_ISO_PKT, HCI_EVENT_SKWLOG};
+#define C2H_PKT_TYPE_CNT    sizeof(c2h_pkt_types)
+
+static char scomm_vendor_is_c2h_type(uint8_t pkt_type)
+{
+    return (pkt_type == HCI_EVENT_PKT) || (pkt_type == HCI_ACLDATA_PKT) || (pkt_type == HCI_SCODATA_PKT)
+           || (pkt_type == HCI_ISO_PKT) || (pkt_type == HCI_EVENT_SKWLOG);
+}
+
+/*******************************************************************************
+**
+** Function        scomm_vendor_check_resync
+**
+** Description     check if a packet from the controller may start at buffer:
+**                 the header must be plausible and the packet must end where
+**                 the data ends or right before another packet type
+**
+** Returns         SKW_RESYNC_BAD/SKW_RESYNC_UNSURE(data ends too early to
+**                 tell)/SKW_RESYNC_OK
+**
+*******************************************************************************/
+static uint8_t scomm_vendor_check_resync(const uint8_t *buffer, uint32_t len)
+{
+    uint8_t  pkt_type = buffer[0];
+    uint32_t hdr_lens = hci_preamble_sizes[pkt_type] + 1;
+    uint32_t pkt_len;
+
+    if(len < hdr_lens)
+    {
+        return SKW_RESYNC_UNSURE;
+    }
+
+    switch(pkt_type)
+    {
+        case HCI_ACLDATA_PKT:
+        case HCI_SCODATA_PKT:
+        case HCI_ISO_PKT:
+            if(((buffer[1] | (buffer[2] << 8)) & 0x0FFF) > HCI_HANDLE_MAX)
+            {
+                return SKW_RESYNC_BAD;
+            }
+            if((pkt_type == HCI_ISO_PKT) && (buffer[HCI_COMMON_DATA_LENGTH_INDEX + 1] & 0xC0))//14 bits length
+            {
+                return SKW_RESYNC_BAD;
+            }
+            break;
+        case HCI_EVENT_PKT:
+            if(buffer[1] == 0)//no event code 0
+            {
+                return SKW_RESYNC_BAD;
+            }
+            break;
+        default:
+            break;
+    }
+
+    pkt_len = scomm_vendor_get_pkt_len(buffer, hdr_lens);
+    if(pkt_len > SKW_H4_REASM_BUFFER_SIZE)
+    {
+        return SKW_RESYNC_BAD;
+    }
+    if(pkt_len == len)
+    {
+        return SKW_RESYNC_OK;
+    }
+    if(pkt_len > len)
+    {
+        return SKW_RESYNC_UNSURE;
+    }
+    return scomm_vendor_is_c2h_type(buffer[pkt_len]) ? SKW_RESYNC_OK : SKW_RESYNC_BAD;
+}
+
+/*******************************************************************************
+**
+** Function        scomm_vendor_find_valid_type
+**
+** Description     find where the next packet starts after a bad type byte at
+**                 buffer[0]. Candidates are found with one memchr() per type,
+**                 the first one whose header and next packet boundary line up
+**                 wins, else the first one that can not be ruled out yet
+**
+** Returns         bytes to discard, len if nothing can be a packet
+**
+*******************************************************************************/
+int scomm_vendor_find_valid_type(uint8_t *buffer, uint16_t len)
+{
+    const uint8_t *next[C2H_PKT_TYPE_CNT];
+    int unsure = -1;
+
+    if(len <= 1)
+    {
+        return len;
+    }
+
+    for(uint8_t k = 0; k < C2H_PKT_TYPE_CNT; k++)
+    {
+        next[k] = memchr(buffer + 1, c2h_pkt_types[k], len - 1);
+    }
+
+    while(1)
+    {
+        const uint8_t *cand = NULL;
+        uint8_t k_min = 0;
+        int offset;
+
+        for(uint8_t k = 0; k < C2H_PKT_TYPE_CNT; k++)
+        {
+            if((next[k] != NULL) && ((cand == NULL) || (next[k] < cand)))
+            {
+                cand  = next[k];
+                k_min = k;
+            }
+        }
+        if(cand == NULL)
+        {
+            break;
+        }
+
+        offset = cand - buffer;
+        switch(scomm_vendor_check_resync(cand, len - offset))
+        {
+            case SKW_RESYNC_OK:
+                return offset;
+            case SKW_RESYNC_UNSURE:
+                if(unsure < 0)
                 {
-                    object->write_ready(object->context);
-                    //object->read_ready(port_index);
+                    unsure = offset;
                 }
-            }
+                break;
+            default:
+                break;
         }
+        next[k_min] = ((offset + 1) < len) ? memchr(cand + 1, c2h_pkt_types[k_min], len - offset - 1) : NULL;
     }
-
-    ALOGD("%s [%d] exit", __func__, port_index);
-    return NULL;
+    return (unsure >= 0) ? unsure : len;
 }
 
 
 /*******************************************************************************
 **
-** Function        scomm_vendor_send_to_host
+** Function        scomm_vendor_set_thread_state
 **
-** Description     send data to host
+** Description     publish the state of the recv thread and wake the waiters
 **
 ** Returns         None
 **
 *******************************************************************************/
-static void scomm_vendor_send_to_host(uint8_t port_index, unsigned char *buffer, unsigned int total_length)
+static void scomm_vendor_set_thread_state(scomm_vnd_st *scomm, char running)
 {
-    unsigned int length = total_length;
-    uint16_t transmitted_length = 0;
-    ssize_t ret;
+    pthread_mutex_lock(&scomm->state_lock);
+    scomm->recv_comm_thread_running = running;
+    pthread_cond_broadcast(&scomm->state_cond);
+    pthread_mutex_unlock(&scomm->state_lock);
+}
 
+/*******************************************************************************
+**
+** Function        scomm_vendor_wait_thread_state
+**
+** Description     wait until the recv thread reaches the state, or timeout
+**
+** Returns         TRUE if the state is reached
+**
+*******************************************************************************/
+static char scomm_vendor_wait_thread_state(scomm_vnd_st *scomm, char running, uint32_t timeout_ms)
+{
+    struct timespec ts;
+    int res = 0;
 
-    pthread_mutex_lock(&write2host_lock);
-    while ((length > 0) && scomm_vnd[port_index].thread_running)
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    ts.tv_sec  += timeout_ms / 1000;
+    ts.tv_nsec += (timeout_ms % 1000) * 1000000;
+    if(ts.tv_nsec >= 1000000000)
     {
-        RW_NO_INTR(ret = write(scomm_vnd[port_index].uart_fd[1], buffer + transmitted_length, length));
-
-        SKWBT_LOG("write to host ret:%zd", ret);
-        switch (ret)
-        {
-            case -1:
-                ALOGE("In %s, error writing to socket: %s", __func__, strerror(errno));
-                break;
-            case 0:
-                break;
-            default:
-                transmitted_length += ret;
-                length -= ret;
-                break;
-        }
+        ts.tv_sec ++;
+        ts.tv_nsec -= 1000000000;
     }
-    pthread_mutex_unlock(&write2host_lock);
 
-    SKWBT_LOG("write to host[%d] total_length:%d, ret:%zd", port_index, total_length, ret);
+    pthread_mutex_lock(&scomm->state_lock);
+    while((scomm->recv_comm_thread_running != running) && (res != ETIMEDOUT))
+    {
+        res = pthread_cond_timedwait(&scomm->state_cond, &scomm->state_lock, &ts);
+    }
+    res = (scomm->recv_comm_thread_running == running);
+    pthread_mutex_unlock(&scomm->state_lock);
+    return res;
 }
 
-
 /*******************************************************************************
 **
-** Function        scomm_vendor_send_hw_error
+** Function        scomm_vendor_stats_dump
 **
-** Description     send HCI_HW_ERR command to hsot
+** Description     write the data path stats into the btsnoop log directory
+**                 and a summary into SKW_STATS_SUMMARY_PROP
 **
 ** Returns         None
 **
 *******************************************************************************/
-
-void scomm_vendor_send_hw_error()
+static void scomm_vendor_stats_dump()
 {
-    unsigned char p_buf[10];
-
-    ALOGE("%s, CP Error", __func__);
+    char path[PATH_MAX];
+    char summary[PROPERTY_VALUE_MAX];
+    const char *dir_end = strrchr(skw_btsnoop_path, '/');
 
-    p_buf[0] = HCI_EVENT_PKT;//event
-    p_buf[1] = HCI_HARDWARE_ERROR_EVENT;//hardware error
-    p_buf[2] = 0x01;//len
-    p_buf[3] = HWERR_CODE_CP_ERROR;//userial error code
-    scomm_vendor_send_to_host(0, p_buf, 4);
+    if(dir_end != NULL)
+    {
+        snprintf(path, sizeof(path), "%.*s/%s", (int)(dir_end - skw_btsnoop_path), skw_btsnoop_path, SKW_STATS_DUMP_FILE);
+        skw_stats_dump(path);
+    }
+    skw_stats_summary(summary, sizeof(summary));
+    property_set(SKW_STATS_SUMMARY_PROP, summary);
 }
 
 /*******************************************************************************
 **
-** Function        scomm_vendor_find_valid_type
+** Function        scomm_vendor_stats_poll
 **
-** Description     find the index of valid packet type
+** Description     dump the stats if SKW_STATS_DUMP_PROP is set, checked at
+**                 most once per SKW_STATS_POLL_US
 **
 ** Returns         None
 **
 *******************************************************************************/
-int scomm_vendor_find_valid_type(uint8_t *buffer, uint16_t len)
+static void scomm_vendor_stats_poll()
 {
-    for(int i = 0; i < len; i++)
+    static uint64_t last_poll_us = 0;
+    char value[PROPERTY_VALUE_MAX];
+    uint64_t now_us = scomm_vendor_now_us();
+
+    if((now_us - last_poll_us) < SKW_STATS_POLL_US)
     {
-        switch(buffer[i])
-        {
-            case HCI_EVENT_PKT:
-            case HCI_ACLDATA_PKT:
-            case HCI_SCODATA_PKT:
-            //case HCI_COMMAND_PKT:
-            case HCI_EVENT_SKWLOG:
-                return i;
-            default:
-                break;
-        }
-#if 0
-        if((HCI_EVENT_PKT == buffer[i]) || (HCI_ACLDATA_PKT == buffer[i]) || (HCI_SCODATA_PKT == buffer[i]) || (HCI_COMMAND_PKT == buffer[i])
-                || (HCI_EVENT_SKWLOG == buffer[i]))
-        {
-            return i;
-        }
-#endif
+        return;
     }
-    return len;
-}
+    last_poll_us = now_us;
 
+    if((property_get(SKW_STATS_DUMP_PROP, value, "0") > 0) && (value[0] == '1'))
+    {
+        scomm_vendor_stats_dump();
+        property_set(SKW_STATS_DUMP_PROP, "0");
+    }
+}
 
 /*******************************************************************************
 **
@@ -701,13 +1485,18 @@ static void *scomm_vendor_recv_scomm_thread(void *arg)
     pfd[1].events = POLLIN | POLLHUP | POLLERR | POLLRDHUP;
     pfd[1].fd = scomm->fd;
 
-    uint8_t   read_buffer[2056] = {0};
-    uint8_t   str_buffer[2056] = {0};
+    skw_h4_reasm_st *reasm = &scomm->scomm_rx;
+    char      fast_lane = (port_index == BT_COM_PORT_AUDIO) || (port_index == BT_COM_PORT_ISO);
+    struct iovec host_iov[SKW_HOST_IOV_MAX];
+    int       iov_cnt;
+    uint64_t  read_us;
     ssize_t   bytes_read;
-    uint16_t  last_len = 0, rev_len = 0;
+    uint32_t  pkt_len;
     int       ret;
 
-    scomm->recv_comm_thread_running = TRUE;
+    reasm->head = 0;
+    reasm->tail = 0;
+    scomm_vendor_set_thread_state(scomm, TRUE);
     ALOGD("%s [%d] start", __func__, port_index);
 
     while(scomm->thread_running)
@@ -716,6 +1505,10 @@ static void *scomm_vendor_recv_scomm_thread(void *arg)
         {
             ret = poll(pfd, 2, 500);
         } while(ret == -1 && errno == EINTR && scomm->thread_running);
+        if(port_index == BT_COM_PORT_CMDEVT)
+        {
+            scomm_vendor_stats_poll();
+        }
         //exit signal is always at first index
         if(pfd[0].revents && !scomm->thread_running)
         {
@@ -724,9 +1517,7 @@ static void *scomm_vendor_recv_scomm_thread(void *arg)
         }
         if(pfd[1].revents & POLLIN)
         {
-            scomm->is_busying = FALSE;
-            bytes_read = read(scomm->fd, read_buffer + last_len, 2056 - last_len);
-            scomm->is_busying = TRUE;
+            bytes_read = read(scomm->fd, reasm->buffer + reasm->tail, SKW_H4_REASM_BUFFER_SIZE - reasm->tail);
 
             if(bytes_read == 0)
             {
@@ -736,6 +1527,10 @@ static void *scomm_vendor_recv_scomm_thread(void *arg)
                 }
                 break;
             }
+            if((bytes_read < 0) && ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)))
+            {
+                continue;//the node is non-blocking now
+            }
             if(bytes_read < 0)
             {
                 ALOGE("%s, read fail, thread[%d] state:%d, error code:%zd, %s", __func__, port_index, (scomm->thread_running), bytes_read, strerror(errno));
@@ -745,88 +1540,75 @@ static void *scomm_vendor_recv_scomm_thread(void *arg)
                 }
                 break;
             }
-            hex2String(read_buffer + last_len, str_buffer, (bytes_read > 64) ? 64 : bytes_read);
-            SKWBT_LOG("scomm[%d] read:%zd, last_len:%d, %s", port_index, bytes_read, last_len, str_buffer);
+            if(skwdriverlog_en)
+            {
+                uint8_t str_buffer[SKWBT_LOG_HEX_MAX * 2 + 1];
+                hex2String(reasm->buffer + reasm->tail, str_buffer, (bytes_read > SKWBT_LOG_HEX_MAX) ? SKWBT_LOG_HEX_MAX : bytes_read);
+                SKWBT_LOG("scomm[%d] read:%zd, last_len:%d, %s", port_index, bytes_read, reasm->tail - reasm->head, str_buffer);
+            }
+            reasm->tail += bytes_read;
+            read_us = scomm_vendor_now_us();
 
             //data parse for get a commplete packet and capture the snoop log
-            rev_len = bytes_read + last_len;
-            do
+            pkt_len = 0;
+            iov_cnt = 0;
+            while(reasm->head < reasm->tail)
             {
-                uint8_t pkt_type = read_buffer[0];
-                if((pkt_type == HCI_EVENT_PKT) || (pkt_type == HCI_ACLDATA_PKT) || (pkt_type == HCI_SCODATA_PKT) || (pkt_type == HCI_EVENT_SKWLOG) || (pkt_type == HCI_ISO_PKT))
+                uint8_t *pkt_ptr = reasm->buffer + reasm->head;
+                uint16_t rev_len = reasm->tail - reasm->head;
+                uint8_t pkt_type = pkt_ptr[0];
+                if(scomm_vendor_is_c2h_type(pkt_type))
                 {
-                    uint16_t hdr_lens = hci_preamble_sizes[pkt_type] + 1;
-                    if(rev_len >= hdr_lens)
-                    {
-                        uint16_t pkt_len = 0;
-                        //get payload length
-                        if((pkt_type == HCI_ACLDATA_PKT) || (pkt_type == HCI_ISO_PKT))
-                        {
-                            pkt_len = *(uint16_t *)&read_buffer[HCI_COMMON_DATA_LENGTH_INDEX];
-                        }
-                        else if(pkt_type == HCI_EVENT_PKT)
-                        {
-                            pkt_len = read_buffer[HCI_EVENT_DATA_LENGTH_INDEX];
-                        }
-                        else if(pkt_type == HCI_EVENT_SKWLOG)
-                        {
-                            pkt_len = *(uint16_t *)&read_buffer[HCI_SKWLOG_DATA_LENGTH_INDEX];
-                        }
-                        else//cmd/sco
-                        {
-                            pkt_len = read_buffer[HCI_COMMON_DATA_LENGTH_INDEX];
-                        }
-
-                        SKWBT_LOG("rev_len:%d, pkt_type:%d, hdr_lens:%d, pkt_len:%d", rev_len, pkt_type, hdr_lens, pkt_len);
+                    pkt_len = scomm_vendor_get_pkt_len(pkt_ptr, rev_len);
 
-                        pkt_len += hdr_lens;
-                        if(rev_len >= pkt_len)
-                        {
-                            if(pkt_type == HCI_EVENT_SKWLOG)
-                            {
-                                skwlog_write(read_buffer, pkt_len);
-                            }
-                            else//
-                            {
-
-                                skw_btsnoop_capture(read_buffer, TRUE);
-                                scomm_vendor_send_to_host(0, read_buffer, pkt_len);
-                            }
-                            last_len = rev_len - pkt_len;
-                            memcpy(read_buffer, read_buffer + pkt_len, last_len);
-                            if(last_len >= 4)
-                            {
-                                rev_len = last_len;
-                                SKWBT_LOG(" more packet, rev_len:%d ", rev_len);
-                                continue;
-                            }
+                    SKWBT_LOG("rev_len:%d, pkt_type:%d, pkt_len:%d", rev_len, pkt_type, pkt_len);
+                    if((pkt_len == 0) || (pkt_len > rev_len))
+                    {
+                        SKWBT_LOG("need more, rev_len:%d, pkt_len:%d", rev_len, pkt_len);
+                        skw_stats_inc(port_index, SKW_STATS_PARTIAL_READS, 1);
+                        break;
+                    }
+                    skw_stats_pkt(port_index, SKW_STATS_C2H, pkt_type, pkt_len);
 
-                        }
-                        else
-                        {
-                            last_len = rev_len;
-                            SKWBT_LOG("need more, rev_len:%d, pkt_len:%d, last_len:%d", rev_len, pkt_len, last_len);
-                        }
+                    if(pkt_type == HCI_EVENT_SKWLOG)
+                    {
+                        skwlog_write(pkt_ptr, pkt_len);
+                    }
+                    else if(fast_lane && scomm_vendor_send_fast_to_host(port_index, pkt_ptr, pkt_len, read_us))
+                    {
+                        skw_btsnoop_capture(pkt_ptr, TRUE);
                     }
-                    else
+                    else//
                     {
-                        last_len = rev_len;
+                        skw_btsnoop_capture(pkt_ptr, TRUE);
+                        if(iov_cnt >= SKW_HOST_IOV_MAX)
+                        {
+                            scomm_vendor_send_iov_to_host(0, host_iov, iov_cnt);
+                            skw_stats_lat(port_index, SKW_STATS_C2H, iov_cnt, read_us, scomm_vendor_now_us());
+                            iov_cnt = 0;
+                        }
+                        host_iov[iov_cnt].iov_base = pkt_ptr;
+                        host_iov[iov_cnt].iov_len  = pkt_len;
+                        iov_cnt ++;
                     }
+                    reasm->head += pkt_len;
+                    pkt_len = 0;
                 }
                 else//invalid data, discard
                 {
-                    int vLen = scomm_vendor_find_valid_type(read_buffer, rev_len);
+                    int vLen = scomm_vendor_find_valid_type(pkt_ptr, rev_len);
                     ALOGE("invalid type:%02X, vLen:%d", pkt_type, vLen);
-
-                    last_len = rev_len - vLen;
-                    if(vLen < rev_len)
-                    {
-                        memcpy(read_buffer, read_buffer + vLen, last_len);
-                    }
+                    skw_stats_inc(port_index, SKW_STATS_DISCARDS, vLen);
+                    reasm->head += vLen;
                 }
-
-                break;
-            } while (1);
+            }
+            //all the complete packets of this read go to host in one batch
+            if(iov_cnt > 0)
+            {
+                scomm_vendor_send_iov_to_host(0, host_iov, iov_cnt);
+                skw_stats_lat(port_index, SKW_STATS_C2H, iov_cnt, read_us, scomm_vendor_now_us());
+            }
+            scomm_vendor_reasm_compact(reasm, pkt_len);
             continue;
         }
 
@@ -840,10 +1622,8 @@ static void *scomm_vendor_recv_scomm_thread(void *arg)
     }
 
 
-    scomm->is_busying = FALSE;
-    scomm->thread_uart_id = -1;
-
     ALOGD("%s [%d] exit", __func__, port_index);
+    scomm_vendor_set_thread_state(scomm, FALSE);
     return NULL;
 }
 
@@ -861,6 +1641,7 @@ int scomm_vendor_socket_open(uint8_t port_index)
 {
     int ret = 0;
     struct epoll_event event;
+    uint64_t start_us = scomm_vendor_now_us();
     if((ret = socketpair(AF_UNIX, SOCK_STREAM, 0, scomm_vnd[port_index].uart_fd)) < 0)
     {
         ALOGE("%s, errno : %s", __func__, strerror(errno));
@@ -882,6 +1663,8 @@ int scomm_vendor_socket_open(uint8_t port_index)
 
     scomm_vnd[port_index].thread_running = TRUE;
     scomm_vnd[port_index].recv_comm_thread_running = FALSE;
+    scomm_vnd[port_index].host_rx.head = 0;
+    scomm_vnd[port_index].host_rx.tail = 0;
 
     pthread_attr_t thread_attr;
     pthread_attr_init(&thread_attr);
@@ -933,18 +1716,28 @@ int scomm_vendor_socket_open(uint8_t port_index)
         scomm_vnd[port_index].thread_running = FALSE;
         pthread_join(scomm_vnd[port_index].thread_socket_id, NULL);
         scomm_vnd[port_index].thread_socket_id = -1;
+        scomm_vnd[port_index].thread_uart_id = -1;
         return -1;
     }
-    while(!scomm_vnd[port_index].recv_comm_thread_running)
+    if(!scomm_vendor_tx_start(port_index))
+    {
+        ALOGE("%s [%d] no TX queue, host data for this port is dropped", __func__, port_index);
+    }
+    if(port_index == 0)
+    {
+        host_rx_paused = FALSE;
+    }
+
+    if(!scomm_vendor_wait_thread_state(&scomm_vnd[port_index], TRUE, SKW_THREAD_START_WAIT_MS))
     {
-        usleep(20);
+        ALOGE("%s [%d] recv thread start timeout", __func__, port_index);
     }
 
     scomm_vnd[port_index].driver_state = TRUE;
 
     ret = scomm_vnd[port_index].uart_fd[0];
 
-    ALOGD("%s uart_fd:%d", __func__, ret);
+    ALOGD("%s [%d] uart_fd:%d, cost:%lluus", __func__, port_index, ret, (unsigned long long)(scomm_vendor_now_us() - start_us));
     return ret;
 }
 
@@ -1019,14 +1812,59 @@ static void scomm_vendor_socket_close(uint8_t port_index)
 }
 
 
+/*******************************************************************************
+**
+** Function        scomm_vendor_write_bt_state
+**
+** Description     tell the controller BT is going off. The node is
+**                 non-blocking, so wait for the queued host packets to go
+**                 out first, then write the command completely
+**
+** Returns         None
+**
+*******************************************************************************/
 void scomm_vendor_write_bt_state()
 {
     //if(skwbt_transtype & SKWBT_TRANS_TYPE_USB)
     if(chip_version == SKW_CHIPID_6160)
     {
-        char buffer[10] = {0x01, 0x80, 0xFE, 0x01, 0x00};
+        uint8_t buffer[10] = {0x01, 0x80, 0xFE, 0x01, 0x00};
         scomm_vnd_st *scomm = &scomm_vnd[0];
-        write(scomm->fd, buffer, 5);
+        skw_tx_ctx_st *tx = &scomm->tx;
+        struct pollfd pfd;
+        uint32_t offset = 0;
+        int i;
+
+        //a packet the EPOLLOUT handler has started must not be split
+        for(i = 0; (i < SKW_BT_STATE_WAIT_MS) && (tx->ring.buffer != NULL)
+            && ((tx->cur_data != NULL) || !skw_ring_is_empty(&tx->ring)); i++)
+        {
+            usleep(1000);
+        }
+
+        pfd.fd = scomm->fd;
+        pfd.events = POLLOUT;
+        for(i = 0; (offset < 5) && (i < SKW_BT_STATE_WAIT_MS); i++)
+        {
+            ssize_t ret;
+            RW_NO_INTR(ret = write(scomm->fd, buffer + offset, 5 - offset));
+            if(ret > 0)
+            {
+                offset += ret;
+            }
+            else if((ret < 0) && (errno != EAGAIN) && (errno != EWOULDBLOCK))
+            {
+                break;
+            }
+            else
+            {
+                poll(&pfd, 1, 1);
+            }
+        }
+        if(offset < 5)
+        {
+            ALOGE("%s write fail, written:%u, %s", __func__, offset, strerror(errno));
+        }
         usleep(15000);
     }
 }
@@ -1047,7 +1885,8 @@ void scomm_vendor_port_close(uint8_t port_index)
     ssize_t ret;
     int res;
     scomm_vnd_st *scomm = &scomm_vnd[port_index];
-    ALOGD( "%s [%d] start, fd:%d, busy:%d", __func__, port_index, scomm->fd, scomm->is_busying);
+    uint64_t start_us = scomm_vendor_now_us();
+    ALOGD( "%s [%d] start, fd:%d", __func__, port_index, scomm->fd);
 
     if(scomm->fd == -1)
     {
@@ -1057,23 +1896,15 @@ void scomm_vendor_port_close(uint8_t port_index)
     scomm->thread_running = FALSE;
     scomm->driver_state = FALSE;
 
-    while(scomm->is_busying)
-    {
-        usleep(20);
-    }
-
-    res = ioctl(scomm->fd, 0);
-    //ALOGE("res:%d, %s", res, strerror(errno));
+    //the recv threads poll signal_fd[1], so the exit signal goes into signal_fd[0]
+    ALOGD("%s signal_fd:%d", __func__, scomm->signal_fd[0]);
+    RW_NO_INTR(ret = write(scomm->signal_fd[0], &close_signal, 1));
 
-    ALOGE("%s signal_fd:%d", __func__, scomm->signal_fd[1]);
-    RW_NO_INTR(ret = write(scomm->signal_fd[1], &close_signal, 1));
-
-    usleep(300);//wait
-    for(int i = 0; (skwbt_transtype & SKWBT_TRANS_TYPE_SDIO) && (i < 2) && (scomm->thread_uart_id != -1); i++)
+    res = ioctl(scomm->fd, 0);//wake up a read blocked in the driver
+    for(int i = 0; !scomm_vendor_wait_thread_state(scomm, FALSE, SKW_THREAD_EXIT_WAIT_MS) && (skwbt_transtype & SKWBT_TRANS_TYPE_SDIO) && (i < 2); i++)
     {
         res = ioctl(scomm->fd, 0);//try again
-        usleep(200);
-	ALOGD("%s,%d times:%d, res:%d, %s", __func__, port_index, i, res, strerror(errno));
+        ALOGD("%s,%d times:%d, res:%d, %s", __func__, port_index, i, res, strerror(errno));
     }
 
     //scomm close
@@ -1082,20 +1913,20 @@ void scomm_vendor_port_close(uint8_t port_index)
         ALOGE( "%s (fd:%d) FAILED result:%d", __func__, scomm->fd, res);
     }
 
-    ALOGD("Run Here");
-
     if(scomm->thread_uart_id != -1)
     {
         pthread_join(scomm->thread_uart_id, NULL);
+        scomm->thread_uart_id = -1;
     }
 
     scomm_vendor_socket_close(port_index);
+    scomm_vendor_tx_free(port_index);
 
     //close(scomm_vnd[port_index].fd);
     scomm->fd = -1;
 
 
-    ALOGD( "%s [%d] finish", __func__, port_index);
+    ALOGD( "%s [%d] finish, cost:%lluus", __func__, port_index, (unsigned long long)(scomm_vendor_now_us() - start_us));
 
 }
 
@@ -1111,10 +1942,18 @@ void scomm_vendor_port_close(uint8_t port_index)
 void scomm_vendor_close()
 {
     int idx = 0;
+    char value[PROPERTY_VALUE_MAX];
     for(idx = 0; idx < BT_COM_PORT_SIZE; idx++)
     {
         scomm_vendor_port_close(idx);
     }
+
+    ALOGD("%s session stats, snoop:%d, cplog:%d, drvlog:%d", __func__, btsnoop_log_en, btcp_log_en, skwdriverlog_en);
+    skw_stats_report();
+    if((property_get(SKW_STATS_CLOSE_PROP, value, "0") > 0) && (value[0] == '1'))
+    {
+        scomm_vendor_stats_dump();
+    }
     if(btpw_fp > 0)
     {
         close(btpw_fp);
@@ -1130,13 +1969,132 @@ void scomm_vendor_close()
 ** Returns          None
 **
 *******************************************************************************/
+void scomm_vendor_config_callback(void *p_mem);
+
 void scomm_vendor_init_err(HC_BT_HDR   *p_buf)
 {
     hw_cfg_cb.state = HW_CFG_INIT;
     bt_vendor_cbacks->dealloc(p_buf);
-    fclose(hw_cfg_cb.nv_fp);
-    hw_cfg_cb.nv_fp = NULL;
+    if(hw_cfg_cb.nv_image)
+    {
+        hw_cfg_cb.nv_image = NULL;
+        skw_nv_free();//do not reuse an image the controller did not take
+    }
+
+}
+
+/*******************************************************************************
+**
+** Function         scomm_vendor_nv_fill
+**
+** Description      copy the next prebuilt HCI_CMD_SKW_BT_NVDS command into
+**                  p_buf, nv_eof is set with the last one
+**
+** Returns          1: command built, 0: nothing left
+**
+*******************************************************************************/
+static int scomm_vendor_nv_fill(HC_BT_HDR *p_buf)
+{
+    p_buf->len = skw_nv_get_cmd(hw_cfg_cb.nv_image, hw_cfg_cb.nv_cmd_idx, (uint8_t *)(p_buf + 1));
+    if((hw_cfg_cb.nv_cmd_idx + 1) >= hw_cfg_cb.nv_image->cmd_cnt)
+    {
+        hw_cfg_cb.nv_eof = TRUE;
+    }
+    SKWBT_LOG("nv cmd:%d, len:%d", hw_cfg_cb.nv_cmd_idx, p_buf->len);
+    return (p_buf->len > 0);
+}
+
+/*******************************************************************************
+**
+** Function         scomm_vendor_nv_pump
+**
+** Description      keep up to skw_nv_window NVDS commands in flight, every
+**                  command also takes one of the Num_HCI_Command_Packets
+**                  credits left by the last event
+**
+** Returns          p_buf if it was not used, NULL otherwise
+**
+*******************************************************************************/
+static HC_BT_HDR *scomm_vendor_nv_pump(HC_BT_HDR *p_buf)
+{
+    uint8_t credits = hw_cfg_cb.cmd_credits;
+
+    if((credits == 0) && (hw_cfg_cb.nv_inflight == 0))
+    {
+        credits = 1;//nothing outstanding would bring a new credit
+    }
+
+    while(!hw_cfg_cb.nv_eof && (hw_cfg_cb.nv_inflight < skw_nv_window) && (credits > 0))
+    {
+        if(p_buf == NULL)
+        {
+            p_buf = (HC_BT_HDR *)bt_vendor_cbacks->alloc(BT_HC_HDR_SIZE + HCI_CMD_MAX_LEN);
+            if(p_buf == NULL)
+            {
+                break;//go on with the next event
+            }
+            p_buf->event = MSG_STACK_TO_HC_HCI_CMD;
+            p_buf->offset = 0;
+            p_buf->len = 0;
+            p_buf->layer_specific = 0;
+        }
+
+        if(scomm_vendor_nv_fill(p_buf) == 0)
+        {
+            break;
+        }
+
+        if(bt_vendor_cbacks->xmit_cb(HCI_CMD_SKW_BT_NVDS, p_buf, scomm_vendor_config_callback) == FALSE)//send error
+        {
+            ALOGE("%s send nv cmd:%d fail", __func__, hw_cfg_cb.nv_cmd_idx);
+            bt_vendor_cbacks->fwcfg_cb(BT_VND_OP_RESULT_FAIL);
+            scomm_vendor_init_err(p_buf);
+            return NULL;
+        }
+        hw_cfg_cb.nv_cmd_idx ++;
+        hw_cfg_cb.nv_inflight ++;
+        credits --;
+        p_buf = NULL;
+    }
+    hw_cfg_cb.cmd_credits = credits;
+    return p_buf;
+}
 
+/*******************************************************************************
+**
+** Function         scomm_vendor_uart_baud_send
+**
+** Description      ask the controller to move to skw_uart_baud, only on UART
+**                  transport, only if skwbt.conf names the vendor opcode and
+**                  only if the rate differs from the one the port was opened
+**                  with. The parameter is the rate in bps, 4 bytes LE
+**
+** Returns          TRUE if the command is sent
+**
+*******************************************************************************/
+static uint8_t scomm_vendor_uart_baud_send(HC_BT_HDR *p_buf)
+{
+    uint8_t cfg_baud;
+    uint8_t *ptr = (uint8_t *) (p_buf + 1);
+
+    if(!(skwbt_transtype & SKWBT_TRANS_TYPE_UART) || (skw_uart_baud == 0) || (skw_uart_baud_opcode == 0))
+    {
+        return FALSE;
+    }
+    if(!scomm_vendor_baud_cfg(skw_uart_baud, &cfg_baud) || (cfg_baud == userial_H4_cfg.baud))
+    {
+        return FALSE;
+    }
+
+    UINT16_TO_STREAM(ptr, skw_uart_baud_opcode);
+    UINT8_TO_STREAM(ptr, 4);
+    UINT32_TO_STREAM(ptr, skw_uart_baud);
+    p_buf->len = 3 + 4;//packet len
+
+    hw_cfg_cb.baudrate = skw_uart_baud;
+    hw_cfg_cb.baud_cfg = cfg_baud;
+    bt_vendor_cbacks->xmit_cb(skw_uart_baud_opcode, p_buf, scomm_vendor_config_callback);
+    return TRUE;
 }
 
 /*******************************************************************************
@@ -1162,10 +2120,23 @@ void scomm_vendor_config_callback(void *p_mem)
         status = *((uint8_t *)(p_evt_buf + 1) + HCI_EVT_CMD_CMPL_STATUS_OFFSET);
         uint8_t *p = (uint8_t *)(p_evt_buf + 1) + HCI_EVT_CMD_CMPL_OPCODE_OFFSET;
         STREAM_TO_UINT16(opcode, p);
+        hw_cfg_cb.cmd_credits = *((uint8_t *)(p_evt_buf + 1) + HCI_EVT_CMD_CMPL_NUM_PKTS_OFFSET);
+        if((opcode == HCI_CMD_SKW_BT_NVDS) && (hw_cfg_cb.nv_inflight > 0))
+        {
+            hw_cfg_cb.nv_inflight --;
+        }
     }
 
 
     ALOGD("%s status:%d ,opcode:%04X", __func__, status, opcode);
+    if((status != 0) && (hw_cfg_cb.state == HW_CFG_SET_UART_BAUD))
+    {
+        //the controller stays at the open rate, go on with it
+        ALOGE("%s uart baud %u rejected, status:%d", __func__, hw_cfg_cb.baudrate, status);
+        hw_cfg_cb.baudrate = 0;
+        status = 0;
+    }
+
     if((status == 0) && bt_vendor_cbacks)
     {
         p_buf = (HC_BT_HDR *)bt_vendor_cbacks->alloc(BT_HC_HDR_SIZE + HCI_CMD_MAX_LEN);
@@ -1184,6 +2155,26 @@ void scomm_vendor_config_callback(void *p_mem)
         {
             case HW_CFG_START:
             {
+                if(scomm_vendor_uart_baud_send(p_buf))
+                {
+                    hw_cfg_cb.state = HW_CFG_SET_UART_BAUD;
+                    break;
+                }
+            }
+            case HW_CFG_SET_UART_BAUD:
+            {
+                if((hw_cfg_cb.state == HW_CFG_SET_UART_BAUD) && (hw_cfg_cb.baudrate != 0))
+                {
+                    if(!scomm_vendor_uart_set_baud(BT_COM_PORT_CMDEVT, hw_cfg_cb.baud_cfg))
+                    {
+                        ALOGE("%s unable to switch uart to %u", __func__, hw_cfg_cb.baudrate);
+                        bt_vendor_cbacks->fwcfg_cb(BT_VND_OP_RESULT_FAIL);
+                        scomm_vendor_init_err(p_buf);
+                        break;
+                    }
+                    ALOGD("uart baud switched to %u", hw_cfg_cb.baudrate);
+                }
+
                 uint8_t *ptr = (uint8_t *) (p_buf + 1);
                 UINT16_TO_STREAM(ptr, HCI_READ_LOCAL_VERSION_INFO);
                 UINT8_TO_STREAM(ptr, 0);
@@ -1196,7 +2187,6 @@ void scomm_vendor_config_callback(void *p_mem)
             case HW_CFG_READ_HCI_VERSION:
             {
                 char file_name[128] = {0};
-                uint8_t skip_header = 0;
                 uint8_t *p = (uint8_t *)(p_evt_buf + 1) + 7;
                 STREAM_TO_UINT16(chip_version, p);
 
@@ -1206,7 +2196,6 @@ void scomm_vendor_config_callback(void *p_mem)
                 {
                     case SKW_CHIPID_6316://0x6316
                     {
-                        skip_header = 1;
                         sprintf(file_name, "%s/sv6316.nvbin", SKWBT_NV_FILE_PATH);
                         break;
                     }
@@ -1218,131 +2207,47 @@ void scomm_vendor_config_callback(void *p_mem)
                     }
                 }
 
-                hw_cfg_cb.nv_fp = fopen(file_name, "rb");
-                if(!hw_cfg_cb.nv_fp)
+                hw_cfg_cb.nv_image = skw_nv_load(chip_version, file_name);
+                if(!hw_cfg_cb.nv_image)
                 {
-                    ALOGE("%s unable to open nv file:%s: %s", __func__, SKWBT_NV_FILE_PATH, strerror(errno));
+                    ALOGE("%s unable to load nv file:%s", __func__, file_name);
                     bt_vendor_cbacks->fwcfg_cb(BT_VND_OP_RESULT_FAIL);
                     hw_cfg_cb.state = HW_CFG_INIT;
                     return;
                 }
-                hw_cfg_cb.file_offset = 0;
+                hw_cfg_cb.nv_cmd_idx = 0;
+                hw_cfg_cb.nv_inflight = 0;
+                hw_cfg_cb.nv_eof      = FALSE;
+                hw_cfg_cb.nv_start_us = scomm_vendor_now_us();
                 hw_cfg_cb.state = HW_CFG_NV_SEND;
-                if(skip_header)//skip header
-                {
-                    char buffer[6];
-                    fread(buffer, 1, 4, hw_cfg_cb.nv_fp);
-                }
             }
             case HW_CFG_NV_SEND:
             {
-                uint8_t len = 0, res = 0;
-                uint8_t *ptr = (uint8_t *) (p_buf + 1);//skip header
-                UINT16_TO_STREAM(ptr, HCI_CMD_SKW_BT_NVDS);
-
-                if(chip_version == SKW_CHIPID_6316)//0x6316
+                p_buf = scomm_vendor_nv_pump(p_buf);
+                if(hw_cfg_cb.state != HW_CFG_NV_SEND)
                 {
-                    uint8_t tmp_buffer[10] = {0};
-                    uint8_t *param_buf = ptr + 3;
-                    uint8_t nv_tag = 0;
-                    int  nv_param_len = 0;
-                    int  total_len = 0;
-                    char file_end = 0;
-                    int  file_ptr;
-                    while(1)
-                    {
-                        file_ptr = ftell(hw_cfg_cb.nv_fp);
-                        len = fread(tmp_buffer, 1, 3, hw_cfg_cb.nv_fp);
-                        if((len < 3) || feof(hw_cfg_cb.nv_fp))
-                        {
-                            file_end = 1;
-                            break;
-                        }
-                        memcpy(param_buf + total_len, tmp_buffer, 3);
-                        nv_param_len = tmp_buffer[2];
-                        nv_tag = tmp_buffer[0];
-                        ALOGD("tag:%d, nv_param_len:%d, file_ptr:%d", tmp_buffer[0], nv_param_len, file_ptr);
-
-                        if((nv_param_len + total_len + 3) > 252)//252 + 3
-                        {
-                            fseek(hw_cfg_cb.nv_fp, file_ptr, SEEK_SET);
-                            break;
-                        }
-                        total_len += 3;
-                        if(nv_param_len > 0)
-                        {
-                            len = fread(param_buf + total_len, 1, nv_param_len, hw_cfg_cb.nv_fp);
-                            if(len < nv_param_len)
-                            {
-                                ALOGE("%s, len:%d, nv_param_len:%d", __func__, len, nv_param_len);
-                                scomm_vendor_init_err(p_buf);
-                                break;
-                            }
-                            if(nv_tag == NV_TAG_BD_ADDR)
-                            {
-                                skw_addr_get(param_buf + total_len + 3);
-                            }
-                            total_len += len;
-                        }
-                    }
-                    if(total_len > 0)
-                    {
-                        ptr[0] = (total_len + 2);//payload len
-                        ptr[1] = hw_cfg_cb.file_offset;
-                        ptr[2] = total_len;//para len
-                        p_buf->len = total_len + 2 + 3;//packet len
-                        res = bt_vendor_cbacks->xmit_cb(HCI_CMD_SKW_BT_NVDS, p_buf, scomm_vendor_config_callback);
-                        hw_cfg_cb.file_offset ++;
-                        if(res == FALSE)//send error
-                        {
-                            scomm_vendor_init_err(p_buf);
-                            break;
-                        }
-                    }
-                    if(file_end)
-                    {
-                        hw_cfg_cb.state = HW_CFG_WRITE_BD_ADDR;
-                        fclose(hw_cfg_cb.nv_fp);
-                        hw_cfg_cb.nv_fp = NULL;
-                    }
+                    break;//send error, already reported
                 }
-                else
+                if(!hw_cfg_cb.nv_eof || (hw_cfg_cb.nv_inflight > 0))
                 {
-                    len = fread(ptr + 3, 1, NV_FILE_RD_BLOCK_SIZE, hw_cfg_cb.nv_fp);
-                    ptr[0] = (len + 2);//payload len
-                    ptr[1] = hw_cfg_cb.file_offset;
-                    ptr[2] = len;//para len
-                    p_buf->len = len + 2 + 3;//packet len
-                    if(0 == hw_cfg_cb.file_offset)
-                    {
-                        //*(ptr + 3 + 3) = 'A';
-                        //byte7
-                        skw_addr_get(ptr + 3 + 7);
-                    }
-                    else if(1 == hw_cfg_cb.file_offset)
-                    {
-                        *(ptr + 3 + 62) |= 0x80;
-                    }
-
-                    res = bt_vendor_cbacks->xmit_cb(HCI_CMD_SKW_BT_NVDS, p_buf, scomm_vendor_config_callback);
-
-                    ALOGD("len:%d, file_offset:%d, plen:%d,%d res:%d", len, hw_cfg_cb.file_offset, p_buf->len, ptr[0], res);
-
-                    hw_cfg_cb.file_offset ++;
-
-                    if((len < NV_FILE_RD_BLOCK_SIZE) || (len == 0) || feof(hw_cfg_cb.nv_fp))//end of file
+                    if(p_buf)
                     {
-                        hw_cfg_cb.state = HW_CFG_WRITE_BD_ADDR;
-                        fclose(hw_cfg_cb.nv_fp);
-                        hw_cfg_cb.nv_fp = NULL;
+                        bt_vendor_cbacks->dealloc(p_buf);
                     }
-                    if(res == FALSE)//send error
+                    if(hw_cfg_cb.nv_inflight == 0)
                     {
-                        scomm_vendor_init_err(p_buf);
+                        //nothing went out, no event will come to go on with
+                        ALOGE("%s nv download stalled at cmd:%d", __func__, hw_cfg_cb.nv_cmd_idx);
+                        bt_vendor_cbacks->fwcfg_cb(BT_VND_OP_RESULT_FAIL);
+                        hw_cfg_cb.state = HW_CFG_INIT;
+                        hw_cfg_cb.nv_image = NULL;
+                        skw_nv_free();
                     }
-
+                    break;
                 }
-                break;
+                ALOGD("chip:0x%04X nv download done, cmds:%d, window:%d, cost:%lluus", chip_version, hw_cfg_cb.nv_cmd_idx,
+                      skw_nv_window, (unsigned long long)(scomm_vendor_now_us() - hw_cfg_cb.nv_start_us));
+                hw_cfg_cb.state = HW_CFG_WRITE_BD_ADDR;
             }
             case HW_CFG_WRITE_BD_ADDR:
             {
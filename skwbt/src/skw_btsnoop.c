@@ -11,13 +11,39 @@
 #include "skw_btsnoop.h"
 #include <unistd.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <poll.h>
 #include "skw_log.h"
 #include "skw_common.h"
+#include "skw_ring.h"
 
 
 
 char skw_btsnoop_path[1024] = {'\0'};
-static pthread_mutex_t btsnoop_log_lock;
+
+static skw_ring_st   btsnoop_ring;
+static pthread_t     btsnoop_thread_id;
+static volatile char btsnoop_thread_running = FALSE;
+static int           btsnoop_event_fd = -1;
+static atomic_char   btsnoop_writer_idle;
+
+//segment backend, enabled when BtSnoopSegmentSize is set in skwbt.conf
+typedef struct
+{
+    int      fd;
+    uint8_t *base;
+    uint32_t used;
+    uint32_t index;
+} skw_btsnoop_seg_st;
+
+uint32_t btsnoop_seg_size = 0;
+uint32_t btsnoop_seg_cnt  = SKW_BTSNOOP_SEG_CNT_DEF;
+static skw_btsnoop_seg_st  btsnoop_segs[2] = {{-1, NULL, 0, 0}, {-1, NULL, 0, 0}};
+static skw_btsnoop_seg_st *btsnoop_seg_cur  = &btsnoop_segs[0];
+static skw_btsnoop_seg_st *btsnoop_seg_next = &btsnoop_segs[1];
+static char btsnoop_seg_failed = FALSE;//last prepare failed, error already logged
 
 char btsnoop_save_log                     = FALSE;
 static int hci_btsnoop_fd                 = -1;
@@ -146,17 +172,397 @@ void skw_btsnoop_open()
     }
 }
 
+static void skw_btsnoop_seg_name(char *name, uint32_t index)
+{
+    snprintf(name, PATH_MAX, "%s.%02u", skw_btsnoop_path, index);
+}
+
+/*******************************************************************************
+**
+** Function        skw_btsnoop_seg_prepare
+**
+** Description     create, preallocate and map a segment file with the btsnoop
+**                 file header already in place. The file is never left sparse:
+**                 a store into a hole the filesystem cannot back raises
+**                 SIGBUS, so the segment fails when fallocate does. Only the
+**                 first of consecutive failures is logged.
+**
+** Returns         TRUE/FALSE
+**
+*******************************************************************************/
+static char skw_btsnoop_seg_prepare(skw_btsnoop_seg_st *seg, uint32_t index)
+{
+    char name[PATH_MAX];
+
+    skw_btsnoop_seg_name(name, index);
+    seg->index = index;
+    seg->used  = 0;
+    seg->base  = NULL;
+    seg->fd    = open(name, O_RDWR | O_CREAT | O_TRUNC, S_IRUSR | S_IWUSR | S_IRGRP | S_IWGRP | S_IROTH);
+    if(seg->fd < 0)
+    {
+        if(!btsnoop_seg_failed)
+        {
+            ALOGE("%s unable to open '%s': %s", __func__, name, strerror(errno));
+        }
+        btsnoop_seg_failed = TRUE;
+        return FALSE;
+    }
+
+    if(fallocate(seg->fd, 0, 0, btsnoop_seg_size) != 0)
+    {
+        if(!btsnoop_seg_failed)
+        {
+            ALOGE("%s unable to allocate '%s': %s", __func__, name, strerror(errno));
+        }
+        btsnoop_seg_failed = TRUE;
+        close(seg->fd);
+        seg->fd = -1;
+        unlink(name);
+        return FALSE;
+    }
+
+    seg->base = (uint8_t *)mmap(NULL, btsnoop_seg_size, PROT_READ | PROT_WRITE, MAP_SHARED, seg->fd, 0);
+    if(seg->base == MAP_FAILED)
+    {
+        if(!btsnoop_seg_failed)
+        {
+            ALOGE("%s unable to map '%s': %s", __func__, name, strerror(errno));
+        }
+        btsnoop_seg_failed = TRUE;
+        seg->base = NULL;
+        close(seg->fd);
+        seg->fd = -1;
+        unlink(name);
+        return FALSE;
+    }
+
+    memcpy(seg->base, "btsnoop\0\0\0\0\1\0\0\x3\xea", 16);
+    seg->used = 16;
+    ALOGD("%s '%s', fd:%d%s", __func__, name, seg->fd, btsnoop_seg_failed ? ", recovered" : "");
+    btsnoop_seg_failed = FALSE;
+    return TRUE;
+}
+
+/*******************************************************************************
+**
+** Function        skw_btsnoop_seg_finish
+**
+** Description     unmap a segment and cut the unused tail off the file
+**
+** Returns         None
+**
+*******************************************************************************/
+static void skw_btsnoop_seg_finish(skw_btsnoop_seg_st *seg)
+{
+    if(seg->base)
+    {
+        munmap(seg->base, btsnoop_seg_size);
+        seg->base = NULL;
+    }
+    if(seg->fd >= 0)
+    {
+        ftruncate(seg->fd, seg->used);
+        close(seg->fd);
+        seg->fd = -1;
+    }
+}
+
+/*******************************************************************************
+**
+** Function        skw_btsnoop_seg_open
+**
+** Description     map the first two segments, starting after the newest
+**                 segment left by the last session.
+**                 The segments replace BtSnoopSaveLog and SkwLogSlice: the
+**                 old segments are the saved log, and the CP log is not
+**                 reopened together with the btsnoop log in this mode.
+**
+** Returns         TRUE/FALSE
+**
+*******************************************************************************/
+static char skw_btsnoop_seg_open()
+{
+    char name[PATH_MAX];
+    struct stat buf;
+    struct timespec newest = {0, 0};
+    uint32_t start = 0;
+    int32_t last = -1;
+
+    for(uint32_t i = 0; i < btsnoop_seg_cnt; i++)
+    {
+        skw_btsnoop_seg_name(name, i);
+        if(stat(name, &buf) != 0)
+        {
+            continue;
+        }
+        //timestamps are coarse, segments closed back to back can tie, the
+        //one written later is then the successor of the other one
+        if((last < 0) || (buf.st_mtim.tv_sec > newest.tv_sec)
+            || ((buf.st_mtim.tv_sec == newest.tv_sec) && (buf.st_mtim.tv_nsec > newest.tv_nsec))
+            || ((buf.st_mtim.tv_sec == newest.tv_sec) && (buf.st_mtim.tv_nsec == newest.tv_nsec)
+                && (i == ((uint32_t)last + 1) % btsnoop_seg_cnt)))
+        {
+            newest = buf.st_mtim;
+            last = i;
+        }
+    }
+    if(last >= 0)
+    {
+        start = ((uint32_t)last + 1) % btsnoop_seg_cnt;
+    }
+    if(btsnoop_save_log || skwlog_slice)
+    {
+        ALOGD("%s segment mode, BtSnoopSaveLog/SkwLogSlice do not apply to btsnoop", __func__);
+    }
+
+    btsnoop_seg_cur  = &btsnoop_segs[0];
+    btsnoop_seg_next = &btsnoop_segs[1];
+    btsnoop_seg_next->fd = -1;
+    btsnoop_seg_next->base = NULL;
+    btsnoop_seg_failed = FALSE;
+    if(!skw_btsnoop_seg_prepare(btsnoop_seg_cur, start))
+    {
+        return FALSE;
+    }
+    skw_btsnoop_seg_prepare(btsnoop_seg_next, (start + 1) % btsnoop_seg_cnt);
+    return TRUE;
+}
+
+/*******************************************************************************
+**
+** Function        skw_btsnoop_seg_write
+**
+** Description     copy the records into the mapped segment, switch to the
+**                 prepared next segment when the current one is full.
+**                 A segment that could not be prepared is tried again once
+**                 per batch, records that find no segment count as drops
+**
+** Returns         None
+**
+*******************************************************************************/
+static void skw_btsnoop_seg_write(struct iovec *iov, int iov_cnt)
+{
+    char retried = FALSE;
+
+    for(int i = 0; i < iov_cnt; i++)
+    {
+        if((btsnoop_seg_cur->base != NULL) && ((btsnoop_seg_cur->used + iov[i].iov_len) > btsnoop_seg_size))
+        {
+            skw_btsnoop_seg_st *seg = btsnoop_seg_cur;
+            skw_btsnoop_seg_finish(seg);
+
+            btsnoop_seg_cur  = btsnoop_seg_next;
+            btsnoop_seg_next = seg;
+            skw_btsnoop_seg_prepare(btsnoop_seg_next, (btsnoop_seg_cur->index + 1) % btsnoop_seg_cnt);
+        }
+        if((btsnoop_seg_cur->base == NULL) && !retried)
+        {
+            retried = TRUE;
+            skw_btsnoop_seg_prepare(btsnoop_seg_cur, btsnoop_seg_cur->index);
+        }
+        if(btsnoop_seg_cur->base == NULL)
+        {
+            //segment is not available, lost
+            atomic_fetch_add_explicit(&btsnoop_ring.drops, 1, memory_order_relaxed);
+            continue;
+        }
+
+        memcpy(btsnoop_seg_cur->base + btsnoop_seg_cur->used, iov[i].iov_base, iov[i].iov_len);
+        btsnoop_seg_cur->used += iov[i].iov_len;
+    }
+}
+
+/*******************************************************************************
+**
+** Function        skw_btsnoop_write_iov
+**
+** Description     write all the iovecs to the btsnoop file
+**
+** Returns         None
+**
+*******************************************************************************/
+static void skw_btsnoop_write_iov(struct iovec *iov, int iov_cnt)
+{
+    ssize_t ret;
+
+    while((iov_cnt > 0) && (hci_btsnoop_fd != -1))
+    {
+        RW_NO_INTR(ret = writev(hci_btsnoop_fd, iov, iov_cnt));
+        if(ret <= 0)
+        {
+            ALOGE("%s write fail, ret:%zd, %s", __func__, ret, strerror(errno));
+            return;
+        }
+        while((iov_cnt > 0) && ((size_t)ret >= iov->iov_len))
+        {
+            ret -= iov->iov_len;
+            iov ++;
+            iov_cnt --;
+        }
+        if(iov_cnt > 0)
+        {
+            iov->iov_base = (uint8_t *)iov->iov_base + ret;
+            iov->iov_len -= ret;
+        }
+    }
+}
+
+/*******************************************************************************
+**
+** Function        skw_btsnoop_thread
+**
+** Description     drain the capture ring into the btsnoop file in batches,
+**                 rotation of the file is also done here
+**
+** Returns         None
+**
+*******************************************************************************/
+static void *skw_btsnoop_thread(void *arg)
+{
+    SKW_UNUSED(arg);
+    uint32_t pos[SKW_BTSNOOP_BATCH_SIZE];
+    struct iovec iov[SKW_BTSNOOP_BATCH_SIZE];
+    struct pollfd pfd;
+    uint64_t event;
+
+    pfd.fd = btsnoop_event_fd;
+    pfd.events = POLLIN;
+
+    ALOGD("%s start", __func__);
+
+    while(1)
+    {
+        int cnt = 0;
+        uint32_t len;
+        uint8_t *data;
+
+        //records are already encoded, one iovec each
+        while((cnt < SKW_BTSNOOP_BATCH_SIZE) && ((data = skw_ring_claim(&btsnoop_ring, &pos[cnt], &len)) != NULL))
+        {
+            iov[cnt].iov_base = data;
+            iov[cnt].iov_len  = len;
+
+            btsnoop_rev_length += len - SKW_BTSNOOP_REC_HDR_SIZE;
+            cnt ++;
+        }
+
+        if(cnt == 0)
+        {
+            if(!btsnoop_thread_running)
+            {
+                break;
+            }
+            //sleep until the capture path kicks us
+            atomic_store(&btsnoop_writer_idle, TRUE);
+            if(skw_ring_is_empty(&btsnoop_ring))
+            {
+                poll(&pfd, 1, 500);
+                if(pfd.revents & POLLIN)
+                {
+                    read(btsnoop_event_fd, &event, sizeof(event));
+                }
+            }
+            atomic_store(&btsnoop_writer_idle, FALSE);
+            continue;
+        }
+
+        if(btsnoop_seg_size > 0)
+        {
+            skw_btsnoop_seg_write(iov, cnt);
+        }
+        else
+        {
+            skw_btsnoop_write_iov(iov, cnt);
+        }
+
+        for(int i = 0; i < cnt; i++)
+        {
+            skw_ring_release(&btsnoop_ring, pos[i]);
+        }
+
+        if((btsnoop_seg_size == 0) && (btsnoop_rev_length >= (1024 * 1024 * 1024))) //1GB
+        {
+            close(hci_btsnoop_fd);
+            hci_btsnoop_fd = -1;
+            skw_btsnoop_open();
+        }
+    }
+
+    ALOGD("%s exit", __func__);
+    return NULL;
+}
+
 void skw_btsnoop_init()
 {
-    pthread_mutex_init(&btsnoop_log_lock, NULL);
     btsnoop_cnts = 0;
     //ALOGD("%s btsnoop log file path:%s", __func__,skw_btsnoop_path);
-    skw_btsnoop_open();
+    if(btsnoop_seg_size > 0)
+    {
+        if(btsnoop_seg_cnt < 2)
+        {
+            btsnoop_seg_cnt = 2;
+        }
+        if(!skw_btsnoop_seg_open())
+        {
+            return;
+        }
+    }
+    else
+    {
+        skw_btsnoop_open();
+        if(hci_btsnoop_fd == -1)
+        {
+            return;
+        }
+    }
+
+    if(!skw_ring_init(&btsnoop_ring, SKW_BTSNOOP_RING_SLOTS, SKW_BTSNOOP_REC_HDR_SIZE + SKW_BTSNOOP_MAX_PKT_LEN))
+    {
+        return;
+    }
+
+    btsnoop_event_fd = eventfd(0, 0);
+    atomic_init(&btsnoop_writer_idle, FALSE);
+    btsnoop_thread_running = TRUE;
+    if((btsnoop_event_fd < 0) || (pthread_create(&btsnoop_thread_id, NULL, skw_btsnoop_thread, NULL) != 0))
+    {
+        ALOGE("%s start writer fail: %s", __func__, strerror(errno));
+        btsnoop_thread_running = FALSE;
+        if(btsnoop_event_fd >= 0)
+        {
+            close(btsnoop_event_fd);
+            btsnoop_event_fd = -1;
+        }
+        skw_ring_deinit(&btsnoop_ring);
+    }
 }
 
 void skw_btsnoop_close(void)
 {
-    pthread_mutex_destroy(&btsnoop_log_lock);
+    if(btsnoop_thread_running)
+    {
+        uint64_t event = 1;
+        btsnoop_thread_running = FALSE;
+        write(btsnoop_event_fd, &event, sizeof(event));
+        pthread_join(btsnoop_thread_id, NULL);
+
+        close(btsnoop_event_fd);
+        btsnoop_event_fd = -1;
+        skw_ring_deinit(&btsnoop_ring);
+    }
+    if(btsnoop_seg_size > 0)
+    {
+        //the prepared next segment holds no record, do not leave it behind
+        char name[PATH_MAX];
+        if(btsnoop_seg_next->fd >= 0)
+        {
+            skw_btsnoop_seg_finish(btsnoop_seg_next);
+            skw_btsnoop_seg_name(name, btsnoop_seg_next->index);
+            unlink(name);
+        }
+        skw_btsnoop_seg_finish(btsnoop_seg_cur);
+    }
     if (hci_btsnoop_fd != -1)
     {
         close(hci_btsnoop_fd);
@@ -164,27 +570,48 @@ void skw_btsnoop_close(void)
     hci_btsnoop_fd = -1;
 }
 
-static void skw_btsnoop_write(const void *data, size_t length)
+#define UINT32_TO_BE_STREAM(p, u32) {*(p)++ = (uint8_t)((u32) >> 24); *(p)++ = (uint8_t)((u32) >> 16); *(p)++ = (uint8_t)((u32) >> 8); *(p)++ = (uint8_t)(u32);}
+
+/*******************************************************************************
+**
+** Function        skw_btsnoop_encode_hdr
+**
+** Description     build the 24 bytes btsnoop record header(big endian) in front
+**                 of the packet, so header and payload go out as one block
+**
+** Returns         None
+**
+*******************************************************************************/
+static void skw_btsnoop_encode_hdr(uint8_t *p, uint32_t length, uint32_t incl_len, uint32_t flags, uint32_t drops, uint64_t timestamp)
 {
-    if (hci_btsnoop_fd != -1)
-    {
-        write(hci_btsnoop_fd, data, length);
-    }
+    UINT32_TO_BE_STREAM(p, length);
+    UINT32_TO_BE_STREAM(p, incl_len);
+    UINT32_TO_BE_STREAM(p, flags);
+    UINT32_TO_BE_STREAM(p, drops);
+    UINT32_TO_BE_STREAM(p, (uint32_t)(timestamp >> 32));
+    UINT32_TO_BE_STREAM(p, (uint32_t)(timestamp & 0xFFFFFFFF));
 }
 
+/*******************************************************************************
+**
+** Function        skw_btsnoop_capture
+**
+** Description     copy the packet into the capture ring and return at once,
+**                 the record is dropped(and counted) if the ring is full
+**
+** Returns         None
+**
+*******************************************************************************/
 void skw_btsnoop_capture(const uint8_t *packet, char is_received)
 {
-    int length_he = 0;
-    int length    = 0;
-    int flags     = 0;
-    int drops     = 0;
-    if((!btsnoop_log_en) || (hci_btsnoop_fd == -1))
+    uint32_t length_he = 0;
+    uint32_t flags     = 0;
+    uint32_t pos;
+    if((!btsnoop_log_en) || (!btsnoop_thread_running))
     {
         return ;
     }
 
-    pthread_mutex_lock(&btsnoop_log_lock);
-
     uint8_t type = packet[0];
     switch (type)
     {
@@ -207,44 +634,43 @@ void skw_btsnoop_capture(const uint8_t *packet, char is_received)
             flags = 3;
             break;
         default:
-            pthread_mutex_unlock(&btsnoop_log_lock);
             return;
             //break;
     }
 
-    btsnoop_rev_length += length_he;
-
     //SKWBT_LOG("btsnoop_capture type:%d, len:%d", type, length_he);
 
-    uint64_t timestamp = skw_btsnoop_timestamp();
-    uint32_t time_hi = timestamp >> 32;
-    uint32_t time_lo = timestamp & 0xFFFFFFFF;
-
-    length = htonl(length_he);
-    flags = htonl(flags);
-    drops = htonl(drops);
-    time_hi = htonl(time_hi);
-    time_lo = htonl(time_lo);
-
-    skw_btsnoop_write(&length, 4);
-    skw_btsnoop_write(&length, 4);
-    skw_btsnoop_write(&flags, 4);
-    skw_btsnoop_write(&drops, 4);
-    skw_btsnoop_write(&time_hi, 4);
-    skw_btsnoop_write(&time_lo, 4);
+    uint8_t *data = skw_ring_reserve(&btsnoop_ring, &pos);
+    if(data == NULL)
+    {
+        return;
+    }
 
-    skw_btsnoop_write(packet, length_he);
+    uint32_t incl_len = (length_he > SKW_BTSNOOP_MAX_PKT_LEN) ? SKW_BTSNOOP_MAX_PKT_LEN : length_he;
+    uint32_t drops = atomic_load_explicit(&btsnoop_ring.drops, memory_order_relaxed);
+    skw_btsnoop_encode_hdr(data, length_he, incl_len, flags, drops, skw_btsnoop_timestamp());
+    memcpy(data + SKW_BTSNOOP_REC_HDR_SIZE, packet, incl_len);
+    skw_ring_commit(&btsnoop_ring, pos, SKW_BTSNOOP_REC_HDR_SIZE + incl_len);
 
-    if(btsnoop_rev_length >= (1024 * 1024 * 1024)) //1GB
+    if(atomic_exchange(&btsnoop_writer_idle, FALSE))
     {
-        close(hci_btsnoop_fd);
-        hci_btsnoop_fd = -1;
-        skw_btsnoop_open();
-        //skwlog_reopen(TRUE);
+        uint64_t event = 1;
+        write(btsnoop_event_fd, &event, sizeof(event));
     }
-
-    pthread_mutex_unlock(&btsnoop_log_lock);
 }
 
-
+/*******************************************************************************
+**
+** Function        skw_btsnoop_drops
+**
+** Description     packets lost because the ring was full or no segment
+**                 could be prepared
+**
+** Returns         drop count
+**
+*******************************************************************************/
+uint32_t skw_btsnoop_drops()
+{
+    return atomic_load_explicit(&btsnoop_ring.drops, memory_order_relaxed);
+}
 
@@ -17,12 +17,23 @@
 #include <utils/Log.h>
 #include <errno.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
+#include <sys/eventfd.h>
+#include <poll.h>
 #include "skw_log.h"
 #include "skw_common.h"
+#include "skw_ring.h"
 
 
 static pthread_mutex_t skwlog_lock;
 
+static skw_ring_st   skwlog_ring;
+static pthread_t     skwlog_thread_id;
+static volatile char skwlog_thread_running = FALSE;
+static int           skwlog_event_fd = -1;
+static atomic_char   skwlog_writer_idle;
+static atomic_uint   skwlog_oversize;   //records longer than a ring slot
+
 static int skwlog_fp = -1;
 unsigned int skwlog_rev_length = 0;
 unsigned int skwlog_cnts = 0;
@@ -163,13 +174,152 @@ void skwlog_print_current_time()
     skwlog_write(buffer, 12);
 }
 
+/*******************************************************************************
+**
+** Function        skwlog_write_iov
+**
+** Description     write all the iovecs to skwlog.log, rotate at 1.5GB
+**
+** Returns         None
+**
+*******************************************************************************/
+static void skwlog_write_iov(struct iovec *iov, int iov_cnt)
+{
+    ssize_t ret;
+
+    pthread_mutex_lock(&skwlog_lock);
+    while((iov_cnt > 0) && (skwlog_fp > 0))
+    {
+        RW_NO_INTR(ret = writev(skwlog_fp, iov, iov_cnt));
+        if(ret <= 0)
+        {
+            ALOGE("%s write fail, ret:%zd, %s", __func__, ret, strerror(errno));
+            break;
+        }
+        skwlog_rev_length += ret;
+        while((iov_cnt > 0) && ((size_t)ret >= iov->iov_len))
+        {
+            ret -= iov->iov_len;
+            iov ++;
+            iov_cnt --;
+        }
+        if(iov_cnt > 0)
+        {
+            iov->iov_base = (uint8_t *)iov->iov_base + ret;
+            iov->iov_len -= ret;
+        }
+    }
+
+    if(skwlog_rev_length >= (1536 * 1024 * 1024)) //1.5GB
+    {
+        skwlog_rev_length = 0;
+        close(skwlog_fp);
+        skwlog_fp = -1;
+        skwlog_open(TRUE);
+    }
+    pthread_mutex_unlock(&skwlog_lock);
+}
+
+/*******************************************************************************
+**
+** Function        skwlog_thread
+**
+** Description     drain the CP log ring into skwlog.log in batches, so the
+**                 RX thread never waits for the file
+**
+** Returns         None
+**
+*******************************************************************************/
+static void *skwlog_thread(void *arg)
+{
+    SKW_UNUSED(arg);
+    uint32_t pos[SKWLOG_BATCH_SIZE];
+    struct iovec iov[SKWLOG_BATCH_SIZE];
+    struct pollfd pfd;
+    uint64_t event;
+
+    pfd.fd = skwlog_event_fd;
+    pfd.events = POLLIN;
+
+    ALOGD("%s start", __func__);
+
+    while(1)
+    {
+        int cnt = 0;
+        uint32_t len;
+        uint8_t *data;
+
+        while((cnt < SKWLOG_BATCH_SIZE) && ((data = skw_ring_claim(&skwlog_ring, &pos[cnt], &len)) != NULL))
+        {
+            iov[cnt].iov_base = data;
+            iov[cnt].iov_len  = len;
+            cnt ++;
+        }
+
+        if(cnt == 0)
+        {
+            if(!skwlog_thread_running)
+            {
+                break;
+            }
+            atomic_store(&skwlog_writer_idle, TRUE);
+            if(skw_ring_is_empty(&skwlog_ring))
+            {
+                poll(&pfd, 1, 500);
+                if(pfd.revents & POLLIN)
+                {
+                    read(skwlog_event_fd, &event, sizeof(event));
+                }
+            }
+            atomic_store(&skwlog_writer_idle, FALSE);
+            continue;
+        }
+
+        skwlog_write_iov(iov, cnt);
+
+        for(int i = 0; i < cnt; i++)
+        {
+            skw_ring_release(&skwlog_ring, pos[i]);
+        }
+    }
+
+    ALOGD("%s exit", __func__);
+    return NULL;
+}
+
 void skwlog_init()
 {
     pthread_mutex_init(&skwlog_lock, NULL);
     skwlog_fp = -1;
     skwlog_rev_length = 0;
     skwlog_cnts = 0;
-    if(btcp_log_en && ((!btsnoop_save_log) || (!skwlog_slice)))
+    if(!btcp_log_en)
+    {
+        return;
+    }
+
+    if(!skw_ring_init(&skwlog_ring, SKWLOG_RING_SLOTS, SKWLOG_MAX_PKT_LEN))
+    {
+        return;
+    }
+    atomic_init(&skwlog_writer_idle, FALSE);
+    atomic_init(&skwlog_oversize, 0);
+    skwlog_event_fd = eventfd(0, 0);
+    skwlog_thread_running = TRUE;
+    if((skwlog_event_fd < 0) || (pthread_create(&skwlog_thread_id, NULL, skwlog_thread, NULL) != 0))
+    {
+        ALOGE("%s start writer fail: %s", __func__, strerror(errno));
+        skwlog_thread_running = FALSE;
+        if(skwlog_event_fd >= 0)
+        {
+            close(skwlog_event_fd);
+            skwlog_event_fd = -1;
+        }
+        skw_ring_deinit(&skwlog_ring);
+        return;
+    }
+
+    if((!btsnoop_save_log) || (!skwlog_slice))
     {
         skwlog_open(TRUE);
         if(skwlog_fp > 0)
@@ -181,28 +331,76 @@ void skwlog_init()
 }
 
 
+/*******************************************************************************
+**
+** Function        skwlog_write
+**
+** Description     queue one CP log record for the writer thread, the oldest
+**                 queued record is dropped(and counted) if the ring is full
+**
+** Returns         None
+**
+*******************************************************************************/
 void skwlog_write(unsigned char *buffer, unsigned int length)
 {
-    if(skwlog_fp > 0)
+    uint32_t pos;
+    if(!skwlog_thread_running)
+    {
+        return;
+    }
+    if(length > SKWLOG_MAX_PKT_LEN)
     {
-        pthread_mutex_lock(&skwlog_lock);
+        atomic_fetch_add_explicit(&skwlog_oversize, 1, memory_order_relaxed);
+        return;
+    }
 
-        write(skwlog_fp, buffer, length);
-        skwlog_rev_length += length;
+    uint8_t *data = skw_ring_reserve_evict(&skwlog_ring, &pos);
+    if(data == NULL)
+    {
+        return;
+    }
+    memcpy(data, buffer, length);
+    skw_ring_commit(&skwlog_ring, pos, length);
 
-        if(skwlog_rev_length >= (1536 * 1024 * 1024)) //1.5GB
-        {
-            skwlog_rev_length = 0;
-            close(skwlog_fp);
-            skwlog_fp = -1;
-            skwlog_open(TRUE);
-        }
-        pthread_mutex_unlock(&skwlog_lock);
+    if(atomic_exchange(&skwlog_writer_idle, FALSE))
+    {
+        uint64_t event = 1;
+        write(skwlog_event_fd, &event, sizeof(event));
     }
 }
 
+/*******************************************************************************
+**
+** Function        skwlog_get_drops
+**
+** Description     CP log records lost so far: evicted by newer ones, lost to
+**                 a full ring and too long for a ring slot
+**
+** Returns         None
+**
+*******************************************************************************/
+void skwlog_get_drops(uint32_t *evicts, uint32_t *lost, uint32_t *oversize)
+{
+    *evicts   = atomic_load_explicit(&skwlog_ring.evicts, memory_order_relaxed);
+    *lost     = atomic_load_explicit(&skwlog_ring.drops, memory_order_relaxed);
+    *oversize = atomic_load_explicit(&skwlog_oversize, memory_order_relaxed);
+}
+
 void skwlog_close()
 {
+    if(skwlog_thread_running)
+    {
+        uint64_t event = 1;
+        skwlog_thread_running = FALSE;
+        write(skwlog_event_fd, &event, sizeof(event));
+        pthread_join(skwlog_thread_id, NULL);
+
+        ALOGD("%s evicted:%u, lost:%u, oversize:%u", __func__, atomic_load(&skwlog_ring.evicts),
+              atomic_load(&skwlog_ring.drops), atomic_load(&skwlog_oversize));
+        close(skwlog_event_fd);
+        skwlog_event_fd = -1;
+        skw_ring_deinit(&skwlog_ring);
+    }
     pthread_mutex_destroy(&skwlog_lock);
     if (skwlog_fp != -1)
     {
@@ -212,4 +410,3 @@ void skwlog_close()
     skwlog_rev_length = 0;
     skwlog_cnts = 0;
 }
-
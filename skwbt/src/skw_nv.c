@@ -0,0 +1,408 @@
+/******************************************************************************
+ *
+ *  Copyright (C) 2020-2021 SeekWave Technology
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ *
+ ******************************************************************************/
+
+/******************************************************************************
+ *
+ *  Filename:      skw_nv.c
+ *
+ *  Description:   nv file loading, the NVDS commands are built once and cached
+ *
+ ******************************************************************************/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <utils/Log.h>
+#include "skw_nv.h"
+#include "skw_common.h"
+#include "skw_gen_addr.h"
+#include "bt_vendor_skw.h"
+#include "scom_vendor.h"
+
+
+static skw_nv_image_st nv_image = {.cmds = NULL, .addr_pos = -1};
+
+/*******************************************************************************
+**
+** Function        skw_nv_add_cmd
+**
+** Description     append one NVDS command with para_len parameters
+**
+** Returns         parameter area of the new command
+**
+*******************************************************************************/
+static uint8_t *skw_nv_add_cmd(skw_nv_image_st *image, const uint8_t *param, uint8_t para_len)
+{
+    uint8_t *p = image->cmds + image->used;
+    uint16_t cmd_len = HCI_CMD_PREAMBLE_SIZE + 2 + para_len;
+
+    image->cmd_off[image->cmd_cnt] = image->used;
+    image->cmd_len[image->cmd_cnt] = cmd_len;
+    UINT16_TO_STREAM(p, HCI_CMD_SKW_BT_NVDS);
+    UINT8_TO_STREAM(p, para_len + 2);//payload len
+    UINT8_TO_STREAM(p, image->cmd_cnt);//file offset
+    UINT8_TO_STREAM(p, para_len);
+    memcpy(p, param, para_len);
+
+    image->used += cmd_len;
+    image->cmd_cnt ++;
+    return p;
+}
+
+/*******************************************************************************
+**
+** Function        skw_nv_build_6316
+**
+** Description     pack the TLVs into commands of up to 252 bytes, a TLV is
+**                 never split
+**
+** Returns         TRUE/FALSE
+**
+*******************************************************************************/
+static char skw_nv_build_6316(skw_nv_image_st *image, const uint8_t *data, uint32_t size)
+{
+    uint32_t pos = NV_6316_HEADER_LEN;
+    uint32_t chunk = pos;
+    uint32_t addr_val = 0;
+
+    while(1)
+    {
+        char file_end = (pos > size) || ((size - pos) < 3);
+        uint32_t tlv_len = file_end ? 0 : (3 + data[pos + 2]);
+
+        if(!file_end && ((pos + tlv_len) > size))
+        {
+            ALOGE("%s truncated tag:%d at %u", __func__, data[pos], pos);
+            return FALSE;
+        }
+        if(!file_end && (tlv_len > NV_FILE_RD_BLOCK_SIZE))
+        {
+            ALOGE("%s tag:%d too long:%u", __func__, data[pos], tlv_len);
+            return FALSE;
+        }
+
+        if((file_end || ((pos - chunk + tlv_len) > NV_FILE_RD_BLOCK_SIZE)) && (pos > chunk))
+        {
+            if(image->cmd_cnt >= NV_CMD_MAX_CNT)
+            {
+                ALOGE("%s too many commands", __func__);
+                return FALSE;
+            }
+            uint8_t *param = skw_nv_add_cmd(image, data + chunk, pos - chunk);
+            if(addr_val)
+            {
+                image->addr_pos = (param - image->cmds) + (addr_val - chunk) + 3;
+                addr_val = 0;
+            }
+            chunk = pos;
+        }
+        if(file_end)
+        {
+            break;
+        }
+
+        if((data[pos] == NV_TAG_BD_ADDR) && (tlv_len > 3))
+        {
+            addr_val = pos + 3;
+        }
+        pos += tlv_len;
+    }
+    return TRUE;
+}
+
+/*******************************************************************************
+**
+** Function        skw_nv_build_6160
+**
+** Description     cut the file into blocks of 252 bytes, an empty command
+**                 follows when the size is a multiple of 252
+**
+** Returns         TRUE/FALSE
+**
+*******************************************************************************/
+static char skw_nv_build_6160(skw_nv_image_st *image, const uint8_t *data, uint32_t size)
+{
+    uint32_t pos = 0;
+
+    while(1)
+    {
+        uint32_t len = ((size - pos) > NV_FILE_RD_BLOCK_SIZE) ? NV_FILE_RD_BLOCK_SIZE : (size - pos);
+        if(image->cmd_cnt >= NV_CMD_MAX_CNT)
+        {
+            ALOGE("%s too many commands", __func__);
+            return FALSE;
+        }
+
+        uint8_t *param = skw_nv_add_cmd(image, data + pos, len);
+        if((image->cmd_cnt == 1) && (len >= (NV_6160_ADDR_OFFSET + 3)))
+        {
+            image->addr_pos = (param - image->cmds) + NV_6160_ADDR_OFFSET;
+        }
+        else if((image->cmd_cnt == 2) && (len > NV_6160_FLAG_OFFSET))
+        {
+            param[NV_6160_FLAG_OFFSET] |= 0x80;
+        }
+
+        pos += len;
+        if(len < NV_FILE_RD_BLOCK_SIZE)
+        {
+            break;
+        }
+    }
+    return TRUE;
+}
+
+/*******************************************************************************
+**
+** Function        skw_nv_build
+**
+** Description     build the NVDS commands of the chip from the nv data
+**
+** Returns         TRUE/FALSE
+**
+*******************************************************************************/
+static char skw_nv_build(skw_nv_image_st *image, uint16_t chip_id, const uint8_t *data, uint32_t size)
+{
+    char ret;
+    uint32_t cmd_size = (HCI_CMD_PREAMBLE_SIZE + 2 + NV_FILE_RD_BLOCK_SIZE);
+    uint32_t max_cnt = size / 3 + 2;//no more commands than tags
+
+    if(max_cnt > NV_CMD_MAX_CNT)
+    {
+        max_cnt = NV_CMD_MAX_CNT;
+    }
+
+    free(image->cmds);
+    image->cmds     = (uint8_t *)malloc(max_cnt * cmd_size);
+    image->used     = 0;
+    image->cmd_cnt  = 0;
+    image->addr_pos = -1;
+    if(image->cmds == NULL)
+    {
+        return FALSE;
+    }
+
+    if(chip_id == SKW_CHIPID_6316)
+    {
+        ret = skw_nv_build_6316(image, data, size);
+    }
+    else
+    {
+        ret = skw_nv_build_6160(image, data, size);
+    }
+
+    if((ret == FALSE) || (image->cmd_cnt == 0))
+    {
+        free(image->cmds);
+        image->cmds = NULL;
+        image->cmd_cnt = 0;
+        return FALSE;
+    }
+
+    if(image->addr_pos >= 0)
+    {
+        skw_addr_get(image->cmds + image->addr_pos);
+        memcpy(image->addr, image->cmds + image->addr_pos, 3);
+    }
+    image->chip_id = chip_id;
+    return TRUE;
+}
+
+#if SKWBT_NV_EMBED
+//linked in by skw_nv_blob.S
+extern const uint8_t skw_nv_6160_blob[], skw_nv_6160_blob_end[];
+extern const uint8_t skw_nv_6316_blob[], skw_nv_6316_blob_end[];
+
+/*******************************************************************************
+**
+** Function        skw_nv_load_blob
+**
+** Description     build the NVDS commands from the nv data linked into the
+**                 library
+**
+** Returns         image, NULL if the blob is not valid
+**
+*******************************************************************************/
+static const skw_nv_image_st *skw_nv_load_blob(uint16_t chip_id)
+{
+    const uint8_t *data = skw_nv_6160_blob;
+    uint32_t size = skw_nv_6160_blob_end - skw_nv_6160_blob;
+
+    if(chip_id == SKW_CHIPID_6316)
+    {
+        data = skw_nv_6316_blob;
+        size = skw_nv_6316_blob_end - skw_nv_6316_blob;
+    }
+
+    if(!skw_nv_build(&nv_image, chip_id, data, size))
+    {
+        ALOGE("%s chip:0x%04X invalid blob", __func__, chip_id);
+        return NULL;
+    }
+    nv_image.embedded = TRUE;
+    nv_image.mtime    = 0;
+    nv_image.size     = size;
+    ALOGD("%s chip:0x%04X, embedded, cmds:%d", __func__, chip_id, nv_image.cmd_cnt);
+    return &nv_image;
+}
+#endif
+
+/*******************************************************************************
+**
+** Function        skw_nv_load_file
+**
+** Description     read the whole nv file at once and build the NVDS commands
+**
+** Returns         image, NULL if the file can not be used
+**
+*******************************************************************************/
+static const skw_nv_image_st *skw_nv_load_file(uint16_t chip_id, const char *file_name, const struct stat *st)
+{
+    uint8_t *data;
+    ssize_t ret;
+    int fd;
+
+    fd = open(file_name, O_RDONLY);
+    if(fd < 0)
+    {
+        ALOGE("%s unable to open nv file:%s: %s", __func__, file_name, strerror(errno));
+        return NULL;
+    }
+    data = (uint8_t *)malloc(st->st_size + 1);
+    if(data == NULL)
+    {
+        close(fd);
+        return NULL;
+    }
+    RW_NO_INTR(ret = read(fd, data, st->st_size));
+    close(fd);
+    if(ret != st->st_size)
+    {
+        ALOGE("%s short read:%zd/%lld", __func__, ret, (long long)st->st_size);
+        free(data);
+        return NULL;
+    }
+
+    ret = skw_nv_build(&nv_image, chip_id, data, st->st_size);
+    free(data);
+    if(ret == FALSE)
+    {
+        ALOGE("%s invalid nv file:%s", __func__, file_name);
+        return NULL;
+    }
+    nv_image.embedded = FALSE;
+    nv_image.mtime    = st->st_mtime;
+    nv_image.size     = st->st_size;
+    ALOGD("%s chip:0x%04X, %s, cmds:%d", __func__, chip_id, file_name, nv_image.cmd_cnt);
+    return &nv_image;
+}
+
+/*******************************************************************************
+**
+** Function        skw_nv_load
+**
+** Description     get the NVDS commands of the chip, the file is only read
+**                 when chip, size or mtime differ from the cached image.
+**                 With SKWBT_NV_EMBED the file is an optional override of the
+**                 nv data linked into the library
+**
+** Returns         image, NULL if no nv data can be used
+**
+*******************************************************************************/
+const skw_nv_image_st *skw_nv_load(uint16_t chip_id, const char *file_name)
+{
+    const skw_nv_image_st *image = NULL;
+    char cached = (nv_image.cmds != NULL) && (nv_image.chip_id == chip_id);
+    struct stat st;
+
+    if(stat(file_name, &st) == 0)
+    {
+        if(cached && !nv_image.embedded && (nv_image.mtime == st.st_mtime) && (nv_image.size == st.st_size))
+        {
+            image = &nv_image;
+        }
+        else
+        {
+            cached = FALSE;
+            image = skw_nv_load_file(chip_id, file_name, &st);
+        }
+    }
+    else
+    {
+        ALOGD("%s no nv file:%s: %s", __func__, file_name, strerror(errno));
+    }
+
+#if SKWBT_NV_EMBED
+    if(image == NULL)
+    {
+        if(cached && nv_image.embedded)
+        {
+            image = &nv_image;
+        }
+        else
+        {
+            cached = FALSE;
+            image = skw_nv_load_blob(chip_id);
+        }
+    }
+#endif
+
+    if(cached && (image != NULL))
+    {
+        if(nv_image.addr_pos >= 0)//the bd addr file may be regenerated
+        {
+            skw_addr_get(nv_image.cmds + nv_image.addr_pos);
+            memcpy(nv_image.addr, nv_image.cmds + nv_image.addr_pos, 3);
+        }
+        ALOGD("%s chip:0x%04X cached, embedded:%d, cmds:%d", __func__, chip_id, nv_image.embedded, nv_image.cmd_cnt);
+    }
+    return image;
+}
+
+/*******************************************************************************
+**
+** Function        skw_nv_get_cmd
+**
+** Description     copy the index-th command, opcode first, into buffer
+**
+** Returns         command length, 0 if index is out of range
+**
+*******************************************************************************/
+uint16_t skw_nv_get_cmd(const skw_nv_image_st *image, uint16_t index, uint8_t *buffer)
+{
+    if(index >= image->cmd_cnt)
+    {
+        return 0;
+    }
+    memcpy(buffer, image->cmds + image->cmd_off[index], image->cmd_len[index]);
+    return image->cmd_len[index];
+}
+
+/*******************************************************************************
+**
+** Function        skw_nv_free
+**
+** Description     drop the cached image, the next skw_nv_load rebuilds it.
+**                 Called when the config fails and when the library is
+**                 cleaned up, a successful config keeps it for the next enable
+**
+** Returns         None
+**
+*******************************************************************************/
+void skw_nv_free()
+{
+    free(nv_image.cmds);
+    nv_image.cmds     = NULL;
+    nv_image.used     = 0;
+    nv_image.cmd_cnt  = 0;
+    nv_image.addr_pos = -1;
+}
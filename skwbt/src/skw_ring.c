@@ -0,0 +1,228 @@
+/******************************************************************************
+ *
+ *  Copyright (C) 2020-2021 SeekWave Technology
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ *
+ ******************************************************************************/
+
+/******************************************************************************
+ *
+ *  Filename:      skw_ring.c
+ *
+ *  Description:   bounded lock-free record ring used by the log writers
+ *
+ ******************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+#include <utils/Log.h>
+#include "skw_ring.h"
+#include "skw_common.h"
+
+
+static skw_ring_slot_st *skw_ring_slot(skw_ring_st *ring, uint32_t pos)
+{
+    return (skw_ring_slot_st *)(ring->buffer + (pos & (ring->slot_cnt - 1)) * ring->slot_size);
+}
+
+/*******************************************************************************
+**
+** Function        skw_ring_init
+**
+** Description     allocate slot_cnt(power of 2) slots of data_size bytes
+**
+** Returns         TRUE/FALSE
+**
+*******************************************************************************/
+char skw_ring_init(skw_ring_st *ring, uint32_t slot_cnt, uint32_t data_size)
+{
+    if((slot_cnt == 0) || (slot_cnt & (slot_cnt - 1)))
+    {
+        ALOGE("%s invalid slot count:%u", __func__, slot_cnt);
+        return FALSE;
+    }
+
+    ring->slot_cnt  = slot_cnt;
+    ring->data_size = data_size;
+    ring->slot_size = (sizeof(skw_ring_slot_st) + data_size + 7) & ~7;
+    ring->buffer    = (uint8_t *)malloc(ring->slot_cnt * ring->slot_size);
+    if(ring->buffer == NULL)
+    {
+        ALOGE("%s alloc fail, size:%u", __func__, ring->slot_cnt * ring->slot_size);
+        return FALSE;
+    }
+
+    for(uint32_t i = 0; i < slot_cnt; i++)
+    {
+        atomic_init(&skw_ring_slot(ring, i)->seq, i);
+    }
+    atomic_init(&ring->enqueue_pos, 0);
+    atomic_init(&ring->dequeue_pos, 0);
+    atomic_init(&ring->drops, 0);
+    atomic_init(&ring->evicts, 0);
+    return TRUE;
+}
+
+void skw_ring_deinit(skw_ring_st *ring)
+{
+    free(ring->buffer);
+    ring->buffer = NULL;
+}
+
+/*******************************************************************************
+**
+** Function        skw_ring_try_reserve
+**
+** Description     reserve a free slot without counting a drop when the ring
+**                 is full, for callers that wait for room instead
+**
+** Returns         slot data, NULL if the ring is full
+**
+*******************************************************************************/
+uint8_t *skw_ring_try_reserve(skw_ring_st *ring, uint32_t *pos)
+{
+    uint32_t cur = atomic_load_explicit(&ring->enqueue_pos, memory_order_relaxed);
+
+    while(1)
+    {
+        skw_ring_slot_st *slot = skw_ring_slot(ring, cur);
+        uint32_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        int32_t  dif = (int32_t)(seq - cur);
+
+        if(dif == 0)
+        {
+            if(atomic_compare_exchange_weak_explicit(&ring->enqueue_pos, &cur, cur + 1, memory_order_relaxed, memory_order_relaxed))
+            {
+                *pos = cur;
+                return slot->data;
+            }
+        }
+        else if(dif < 0)//full
+        {
+            return NULL;
+        }
+        else
+        {
+            cur = atomic_load_explicit(&ring->enqueue_pos, memory_order_relaxed);
+        }
+    }
+}
+
+/*******************************************************************************
+**
+** Function        skw_ring_reserve
+**
+** Description     reserve a free slot for a record, the caller fills the data
+**                 and publishes it with skw_ring_commit
+**
+** Returns         slot data, NULL if the ring is full(counted as a drop)
+**
+*******************************************************************************/
+uint8_t *skw_ring_reserve(skw_ring_st *ring, uint32_t *pos)
+{
+    uint8_t *data = skw_ring_try_reserve(ring, pos);
+
+    if(data == NULL)
+    {
+        atomic_fetch_add_explicit(&ring->drops, 1, memory_order_relaxed);
+    }
+    return data;
+}
+
+/*******************************************************************************
+**
+** Function        skw_ring_reserve_evict
+**
+** Description     like skw_ring_reserve, but when the ring is full the oldest
+**                 record is thrown away(counted in evicts) to make room
+**
+** Returns         slot data, NULL if no slot could be freed(counted as a drop)
+**
+*******************************************************************************/
+uint8_t *skw_ring_reserve_evict(skw_ring_st *ring, uint32_t *pos)
+{
+    uint32_t old_pos, old_len;
+
+    for(int i = 0; i < SKW_RING_EVICT_TRIES; i++)
+    {
+        uint8_t *data = skw_ring_try_reserve(ring, pos);
+        if(data != NULL)
+        {
+            return data;
+        }
+        //the oldest record may still be filled by another producer, then give up
+        if(skw_ring_claim(ring, &old_pos, &old_len) == NULL)
+        {
+            break;
+        }
+        skw_ring_release(ring, old_pos);
+        atomic_fetch_add_explicit(&ring->evicts, 1, memory_order_relaxed);
+    }
+
+    atomic_fetch_add_explicit(&ring->drops, 1, memory_order_relaxed);
+    return NULL;
+}
+
+void skw_ring_commit(skw_ring_st *ring, uint32_t pos, uint32_t len)
+{
+    skw_ring_slot_st *slot = skw_ring_slot(ring, pos);
+
+    slot->len = len;
+    atomic_store_explicit(&slot->seq, pos + 1, memory_order_release);
+}
+
+/*******************************************************************************
+**
+** Function        skw_ring_claim
+**
+** Description     take the oldest record out of the ring, the slot stays owned
+**                 by the caller until skw_ring_release
+**
+** Returns         record data, NULL if the ring is empty
+**
+*******************************************************************************/
+uint8_t *skw_ring_claim(skw_ring_st *ring, uint32_t *pos, uint32_t *len)
+{
+    uint32_t cur = atomic_load_explicit(&ring->dequeue_pos, memory_order_relaxed);
+
+    while(1)
+    {
+        skw_ring_slot_st *slot = skw_ring_slot(ring, cur);
+        uint32_t seq = atomic_load_explicit(&slot->seq, memory_order_acquire);
+        int32_t  dif = (int32_t)(seq - (cur + 1));
+
+        if(dif == 0)
+        {
+            if(atomic_compare_exchange_weak_explicit(&ring->dequeue_pos, &cur, cur + 1, memory_order_relaxed, memory_order_relaxed))
+            {
+                *pos = cur;
+                *len = slot->len;
+                return slot->data;
+            }
+        }
+        else if(dif < 0)//empty
+        {
+            return NULL;
+        }
+        else
+        {
+            cur = atomic_load_explicit(&ring->dequeue_pos, memory_order_relaxed);
+        }
+    }
+}
+
+void skw_ring_release(skw_ring_st *ring, uint32_t pos)
+{
+    skw_ring_slot_st *slot = skw_ring_slot(ring, pos);
+
+    atomic_store_explicit(&slot->seq, pos + ring->slot_cnt, memory_order_release);
+}
+
+char skw_ring_is_empty(skw_ring_st *ring)
+{
+    uint32_t cur = atomic_load_explicit(&ring->dequeue_pos, memory_order_seq_cst);
+    skw_ring_slot_st *slot = skw_ring_slot(ring, cur);
+
+    return (atomic_load_explicit(&slot->seq, memory_order_seq_cst) != (cur + 1));
+}
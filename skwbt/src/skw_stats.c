@@ -0,0 +1,370 @@
+/******************************************************************************
+ *
+ *  Copyright (C) 2020-2021 SeekWave Technology
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ *
+ ******************************************************************************/
+
+/******************************************************************************
+ *
+ *  Filename:      skw_stats.c
+ *
+ *  Description:   data path counters and latency histograms
+ *
+ ******************************************************************************/
+
+#define LOG_TAG "skw_stats"
+
+#include <stdio.h>
+#include <string.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <unistd.h>
+#include <utils/Log.h>
+#include "skw_stats.h"
+#include "skw_common.h"
+#include "skw_btsnoop.h"
+#include "skw_log.h"
+
+
+static skw_stats_port_st skw_stats[SKW_STATS_PORT_MAX];
+static const char *skw_stats_dir_name[SKW_STATS_DIR_MAX] = {"host->controller", "controller->host"};
+static const char *skw_stats_type_name[SKW_STATS_TYPE_MAX] = {NULL, "cmd", "acl", "sco", "evt", "iso", NULL, "log"};
+static const char *skw_stats_cnt_name[SKW_STATS_CNT_MAX] = {"discards", "partial_reads", "write_retries", "host_retries"};
+
+typedef struct
+{
+    uint64_t pkts;
+    uint64_t bytes;
+    uint64_t first_us;
+    uint64_t last_us;
+    uint64_t lat[SKW_STATS_LAT_BUCKETS];
+} skw_stats_sum_st;
+
+
+static uint8_t skw_stats_lat_bucket(uint64_t lat_us)
+{
+    uint8_t idx = (lat_us == 0) ? 0 : (64 - __builtin_clzll(lat_us));
+
+    return (idx < SKW_STATS_LAT_BUCKETS) ? idx : (SKW_STATS_LAT_BUCKETS - 1);
+}
+
+/*******************************************************************************
+**
+** Function        skw_stats_reset
+**
+** Description     clear the counters at the start of a session
+**
+** Returns         None
+**
+*******************************************************************************/
+void skw_stats_reset()
+{
+    for(uint8_t port = 0; port < SKW_STATS_PORT_MAX; port++)
+    {
+        skw_stats_port_st *st = &skw_stats[port];
+
+        for(uint8_t dir = 0; dir < SKW_STATS_DIR_MAX; dir++)
+        {
+            for(uint8_t type = 0; type < SKW_STATS_TYPE_MAX; type++)
+            {
+                atomic_store_explicit(&st->pkts[dir][type], 0, memory_order_relaxed);
+                atomic_store_explicit(&st->bytes[dir][type], 0, memory_order_relaxed);
+            }
+            atomic_store_explicit(&st->first_us[dir], 0, memory_order_relaxed);
+            atomic_store_explicit(&st->last_us[dir], 0, memory_order_relaxed);
+            for(uint8_t i = 0; i < SKW_STATS_LAT_BUCKETS; i++)
+            {
+                atomic_store_explicit(&st->lat[dir][i], 0, memory_order_relaxed);
+            }
+        }
+        for(uint8_t i = 0; i < SKW_STATS_CNT_MAX; i++)
+        {
+            atomic_store_explicit(&st->cnt[i], 0, memory_order_relaxed);
+        }
+    }
+}
+
+/*******************************************************************************
+**
+** Function        skw_stats_pkt
+**
+** Description     count a packet of H4 type and len bytes on port
+**
+** Returns         None
+**
+*******************************************************************************/
+void skw_stats_pkt(uint8_t port, uint8_t dir, uint8_t type, uint32_t len)
+{
+    if((port >= SKW_STATS_PORT_MAX) || (dir >= SKW_STATS_DIR_MAX) || (type >= SKW_STATS_TYPE_MAX))
+    {
+        return;
+    }
+    atomic_fetch_add_explicit(&skw_stats[port].pkts[dir][type], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&skw_stats[port].bytes[dir][type], len, memory_order_relaxed);
+}
+
+/*******************************************************************************
+**
+** Function        skw_stats_lat
+**
+** Description     count pkts packets of port that arrived at start_us and
+**                 were handed on at end_us
+**
+** Returns         None
+**
+*******************************************************************************/
+void skw_stats_lat(uint8_t port, uint8_t dir, uint32_t pkts, uint64_t start_us, uint64_t end_us)
+{
+    skw_stats_port_st *st;
+    uint64_t cur = 0;
+
+    if((port >= SKW_STATS_PORT_MAX) || (dir >= SKW_STATS_DIR_MAX) || (pkts == 0))
+    {
+        return;
+    }
+    st = &skw_stats[port];
+
+    atomic_fetch_add_explicit(&st->lat[dir][skw_stats_lat_bucket((end_us > start_us) ? (end_us - start_us) : 0)], pkts, memory_order_relaxed);
+
+    atomic_compare_exchange_strong_explicit(&st->first_us[dir], &cur, start_us, memory_order_relaxed, memory_order_relaxed);
+    cur = atomic_load_explicit(&st->last_us[dir], memory_order_relaxed);
+    while((cur < end_us) && !atomic_compare_exchange_weak_explicit(&st->last_us[dir], &cur, end_us, memory_order_relaxed, memory_order_relaxed))
+    {
+    }
+}
+
+/*******************************************************************************
+**
+** Function        skw_stats_inc
+**
+** Description     add val to one of the SKW_STATS_DISCARDS.. counters of port
+**
+** Returns         None
+**
+*******************************************************************************/
+void skw_stats_inc(uint8_t port, uint8_t cnt, uint32_t val)
+{
+    if((port >= SKW_STATS_PORT_MAX) || (cnt >= SKW_STATS_CNT_MAX))
+    {
+        return;
+    }
+    atomic_fetch_add_explicit(&skw_stats[port].cnt[cnt], val, memory_order_relaxed);
+}
+
+/*******************************************************************************
+**
+** Function        skw_stats_sum
+**
+** Description     add up one direction of a port(or of all ports if port is
+**                 SKW_STATS_PORT_MAX) into sum
+**
+** Returns         None
+**
+*******************************************************************************/
+static void skw_stats_sum(uint8_t port, uint8_t dir, skw_stats_sum_st *sum)
+{
+    uint8_t first = (port < SKW_STATS_PORT_MAX) ? port : 0;
+    uint8_t last  = (port < SKW_STATS_PORT_MAX) ? port : (SKW_STATS_PORT_MAX - 1);
+
+    memset(sum, 0, sizeof(skw_stats_sum_st));
+    for(port = first; port <= last; port++)
+    {
+        skw_stats_port_st *st = &skw_stats[port];
+        uint64_t first_us = atomic_load_explicit(&st->first_us[dir], memory_order_relaxed);
+        uint64_t last_us  = atomic_load_explicit(&st->last_us[dir], memory_order_relaxed);
+
+        for(uint8_t type = 0; type < SKW_STATS_TYPE_MAX; type++)
+        {
+            sum->pkts  += atomic_load_explicit(&st->pkts[dir][type], memory_order_relaxed);
+            sum->bytes += atomic_load_explicit(&st->bytes[dir][type], memory_order_relaxed);
+        }
+        for(uint8_t i = 0; i < SKW_STATS_LAT_BUCKETS; i++)
+        {
+            sum->lat[i] += atomic_load_explicit(&st->lat[dir][i], memory_order_relaxed);
+        }
+        if((first_us != 0) && ((sum->first_us == 0) || (first_us < sum->first_us)))
+        {
+            sum->first_us = first_us;
+        }
+        if(last_us > sum->last_us)
+        {
+            sum->last_us = last_us;
+        }
+    }
+}
+
+/*******************************************************************************
+**
+** Function        skw_stats_lat_percentile
+**
+** Description     upper bound of the latency bucket holding the pct percentile
+**
+** Returns         latency in us, 0 if nothing is counted
+**
+*******************************************************************************/
+static uint64_t skw_stats_lat_percentile(const skw_stats_sum_st *sum, uint8_t pct)
+{
+    uint64_t total = 0, target, acc = 0;
+
+    for(uint8_t i = 0; i < SKW_STATS_LAT_BUCKETS; i++)
+    {
+        total += sum->lat[i];
+    }
+    if(total == 0)
+    {
+        return 0;
+    }
+
+    target = (total * pct + 99) / 100;
+    for(uint8_t i = 0; i < SKW_STATS_LAT_BUCKETS; i++)
+    {
+        acc += sum->lat[i];
+        if(acc >= target)
+        {
+            return 1ULL << i;
+        }
+    }
+    return 1ULL << (SKW_STATS_LAT_BUCKETS - 1);
+}
+
+static int skw_stats_format_dir(char *buf, size_t size, const char *name, const skw_stats_sum_st *sum)
+{
+    uint64_t span = (sum->last_us > sum->first_us) ? (sum->last_us - sum->first_us) : 1;
+
+    return snprintf(buf, size, "%s pkts:%llu, bytes:%llu, avg_len:%llu, time:%llums, %llu pkt/s, %llu B/s, latency p50<%lluus p99<%lluus",
+                    name, (unsigned long long)sum->pkts, (unsigned long long)sum->bytes, (unsigned long long)(sum->pkts ? (sum->bytes / sum->pkts) : 0),
+                    (unsigned long long)(span / 1000), (unsigned long long)(sum->pkts * 1000000 / span), (unsigned long long)(sum->bytes * 1000000 / span),
+                    (unsigned long long)skw_stats_lat_percentile(sum, 50), (unsigned long long)skw_stats_lat_percentile(sum, 99));
+}
+
+/*******************************************************************************
+**
+** Function        skw_stats_report
+**
+** Description     log the packet rate, byte rate and latency of each direction
+**
+** Returns         None
+**
+*******************************************************************************/
+void skw_stats_report()
+{
+    char line[256];
+    skw_stats_sum_st sum;
+
+    for(uint8_t dir = 0; dir < SKW_STATS_DIR_MAX; dir++)
+    {
+        skw_stats_sum(SKW_STATS_PORT_MAX, dir, &sum);
+        if(sum.pkts == 0)
+        {
+            continue;
+        }
+        skw_stats_format_dir(line, sizeof(line), skw_stats_dir_name[dir], &sum);
+        ALOGD("%s", line);
+    }
+}
+
+/*******************************************************************************
+**
+** Function        skw_stats_summary
+**
+** Description     one short line for a system property
+**
+** Returns         length of the line
+**
+*******************************************************************************/
+int skw_stats_summary(char *buf, size_t size)
+{
+    skw_stats_sum_st h2c, c2h;
+    uint32_t discards = 0, retries = 0;
+
+    skw_stats_sum(SKW_STATS_PORT_MAX, SKW_STATS_H2C, &h2c);
+    skw_stats_sum(SKW_STATS_PORT_MAX, SKW_STATS_C2H, &c2h);
+    for(uint8_t port = 0; port < SKW_STATS_PORT_MAX; port++)
+    {
+        discards += atomic_load_explicit(&skw_stats[port].cnt[SKW_STATS_DISCARDS], memory_order_relaxed);
+        retries  += atomic_load_explicit(&skw_stats[port].cnt[SKW_STATS_WRITE_RETRIES], memory_order_relaxed);
+    }
+
+    return snprintf(buf, size, "tx:%llu/%lluK rx:%llu/%lluK p99:%llu/%lluus disc:%u retry:%u",
+                    (unsigned long long)h2c.pkts, (unsigned long long)(h2c.bytes >> 10),
+                    (unsigned long long)c2h.pkts, (unsigned long long)(c2h.bytes >> 10),
+                    (unsigned long long)skw_stats_lat_percentile(&h2c, 99), (unsigned long long)skw_stats_lat_percentile(&c2h, 99),
+                    discards, retries);
+}
+
+/*******************************************************************************
+**
+** Function        skw_stats_dump
+**
+** Description     write all the counters and histograms to a text file
+**
+** Returns         TRUE/FALSE
+**
+*******************************************************************************/
+char skw_stats_dump(const char *path)
+{
+    char line[256];
+    skw_stats_sum_st sum;
+    uint32_t evicts, lost, oversize;
+    FILE *fp = fopen(path, "w");
+
+    if(fp == NULL)
+    {
+        ALOGE("%s unable to open '%s': %s", __func__, path, strerror(errno));
+        return FALSE;
+    }
+
+    for(uint8_t dir = 0; dir < SKW_STATS_DIR_MAX; dir++)
+    {
+        skw_stats_sum(SKW_STATS_PORT_MAX, dir, &sum);
+        skw_stats_format_dir(line, sizeof(line), skw_stats_dir_name[dir], &sum);
+        fprintf(fp, "%s\n", line);
+    }
+
+    for(uint8_t port = 0; port < SKW_STATS_PORT_MAX; port++)
+    {
+        skw_stats_port_st *st = &skw_stats[port];
+
+        fprintf(fp, "\nport %d:", port);
+        for(uint8_t i = 0; i < SKW_STATS_CNT_MAX; i++)
+        {
+            fprintf(fp, " %s:%u", skw_stats_cnt_name[i], atomic_load_explicit(&st->cnt[i], memory_order_relaxed));
+        }
+        fprintf(fp, "\n");
+
+        for(uint8_t dir = 0; dir < SKW_STATS_DIR_MAX; dir++)
+        {
+            skw_stats_sum(port, dir, &sum);
+            if(sum.pkts == 0)
+            {
+                continue;
+            }
+            fprintf(fp, "  %s", skw_stats_dir_name[dir]);
+            for(uint8_t type = 0; type < SKW_STATS_TYPE_MAX; type++)
+            {
+                uint64_t pkts = atomic_load_explicit(&st->pkts[dir][type], memory_order_relaxed);
+                if(pkts > 0)
+                {
+                    fprintf(fp, " %s:%llu/%lluB", skw_stats_type_name[type] ? skw_stats_type_name[type] : "?", (unsigned long long)pkts,
+                            (unsigned long long)atomic_load_explicit(&st->bytes[dir][type], memory_order_relaxed));
+                }
+            }
+            fprintf(fp, "\n    latency");
+            for(uint8_t i = 0; i < SKW_STATS_LAT_BUCKETS; i++)
+            {
+                if(sum.lat[i] > 0)
+                {
+                    fprintf(fp, " <%lluus:%llu", (unsigned long long)(1ULL << i), (unsigned long long)sum.lat[i]);
+                }
+            }
+            fprintf(fp, "\n");
+        }
+    }
+
+    skwlog_get_drops(&evicts, &lost, &oversize);
+    fprintf(fp, "\nsnoop drops:%u\nskwlog evicted:%u, lost:%u, oversize:%u\n", skw_btsnoop_drops(), evicts, lost, oversize);
+    fclose(fp);
+    return TRUE;
+}
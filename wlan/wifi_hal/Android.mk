@@ -55,3 +55,17 @@ LOCAL_HEADER_LIBRARIES := $(L_LIB_HDR)
 
 include $(BUILD_STATIC_LIBRARY)
 
+# Host benchmark of WifiCommand against the kernel's nlctrl family
+# ============================================================
+include $(CLEAR_VARS)
+
+LOCAL_MODULE := wifi_cmd_bench
+LOCAL_CFLAGS := $(L_CFLAGS)
+LOCAL_C_INCLUDES := $(L_INCLUDE_DIR) $(LOCAL_PATH)
+LOCAL_SRC_FILES := bench/wifi_cmd_bench.cpp \
+		   wifi_command.cpp
+LOCAL_HEADER_LIBRARIES := $(L_LIB_HDR)
+LOCAL_SHARED_LIBRARIES := libnl liblog
+LOCAL_MODULE_HOST_OS := linux
+
+include $(BUILD_HOST_EXECUTABLE)
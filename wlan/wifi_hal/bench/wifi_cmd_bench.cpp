@@ -0,0 +1,160 @@
+/**********************************************************************************
+ *
+ * Copyright (C) 2020 SeekWave Technology Co.,Ltd.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ *
+ **********************************************************************************/
+
+/*
+ * Host benchmark of WifiCommand. The kernel's generic netlink controller
+ * stands in for nl80211: every command is a CTRL_CMD_GETFAMILY lookup of
+ * "nlctrl", so the round trip is the same request/reply/ACK exchange
+ * without a wifi driver.
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+#include <netlink/genl/genl.h>
+#include <netlink/genl/ctrl.h>
+
+#include "wifi_command.h"
+
+#define BENCH_DEF_COUNT         20000
+
+class GetFamilyCommand : public WifiCommand {
+public:
+	int family;
+
+	GetFamilyCommand(struct nl_sock *sk)
+		: WifiCommand(sk, GENL_ID_CTRL, 0, CTRL_CMD_GETFAMILY)
+	{
+		family = -1;
+	}
+
+	wifi_error build(wifi_interface_handle handle, void *param)
+	{
+		if (put_string(CTRL_ATTR_FAMILY_NAME, (const char *)param))
+			return WIFI_ERROR_OUT_OF_MEMORY;
+
+		return WIFI_SUCCESS;
+	}
+
+	wifi_error parser(struct nlattr *attr[])
+	{
+		if (attr[CTRL_ATTR_FAMILY_ID])
+			family = nla_get_u16(attr[CTRL_ATTR_FAMILY_ID]);
+
+		return WIFI_SUCCESS;
+	}
+};
+
+static double bench_now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* one command at a time, the way every HAL entry point sends */
+static double bench_sync(struct nl_sock *sk, int count)
+{
+	int i;
+	double start = bench_now();
+
+	for (i = 0; i < count; i++) {
+		GetFamilyCommand cmd(sk);
+
+		cmd.build(NULL, (void *)"nlctrl");
+		if (cmd.send() != WIFI_SUCCESS || cmd.family != GENL_ID_CTRL) {
+			fprintf(stderr, "sync command %d failed\n", i);
+			return 0;
+		}
+	}
+
+	return count / (bench_now() - start);
+}
+
+/* depth commands in flight, then wait for all of them */
+static double bench_async(struct nl_sock *sk, int count, int depth)
+{
+	int i, j;
+	GetFamilyCommand *cmd[SKW_CMD_POOL_SIZE];
+	double start = bench_now();
+
+	for (i = 0; i < count; i += depth) {
+		for (j = 0; j < depth; j++) {
+			cmd[j] = new GetFamilyCommand(sk);
+			cmd[j]->build(NULL, (void *)"nlctrl");
+			cmd[j]->sendAsync(NULL, NULL);
+		}
+
+		for (j = 0; j < depth; j++) {
+			if (cmd[j]->wait() != WIFI_SUCCESS || cmd[j]->family != GENL_ID_CTRL)
+				fprintf(stderr, "async command %d failed\n", i + j);
+
+			delete cmd[j];
+		}
+	}
+
+	return count / (bench_now() - start);
+}
+
+int main(int argc, char *argv[])
+{
+	int opt, depth;
+	int count = BENCH_DEF_COUNT;
+	skw_cmd_pool pool;
+	struct nl_sock *sk;
+
+	while ((opt = getopt(argc, argv, "n:h")) != -1) {
+		switch (opt) {
+		case 'n':
+			count = atoi(optarg);
+			break;
+
+		default:
+			printf("usage: %s [-n commands per run, default %d]\n",
+				argv[0], BENCH_DEF_COUNT);
+			return opt == 'h' ? 0 : 1;
+		}
+	}
+
+	if (count <= 0)
+		return 1;
+
+	sk = nl_socket_alloc();
+	if (sk == NULL || nl_connect(sk, NETLINK_GENERIC)) {
+		fprintf(stderr, "generic netlink socket failed\n");
+		return 1;
+	}
+
+	// no pool registered: nl_msg and nl_cb allocated per command
+	printf("%-26s %10.0f cmd/s\n", "sync, no pool", bench_sync(sk, count));
+
+	skw_cmd_pool_init(&pool, sk);
+
+	printf("%-26s %10.0f cmd/s\n", "sync, pool", bench_sync(sk, count));
+
+	for (depth = 2; depth <= SKW_CMD_POOL_SIZE; depth *= 2)
+		printf("async, pool, %d in flight   %10.0f cmd/s\n",
+			depth, bench_async(sk, count, depth));
+
+	skw_cmd_pool_deinit(&pool);
+	nl_socket_free(sk);
+
+	return 0;
+}
@@ -17,9 +17,11 @@
  *
  **********************************************************************************/
 #include <errno.h>
+#include <stddef.h>
 #include <netlink/netlink.h>
 #include <netlink/genl/genl.h>
 #include <netlink/genl/ctrl.h>
+#include <sys/socket.h>
 #include <sys/types.h>
 #include <unistd.h>
 
@@ -31,6 +33,20 @@
 #define WIFI_HAL_SOCK_EVENT_PORT         645
 #define SOCK_BUFF_SIZE                   0x40000
 
+#define SKW_EVENT_BATCH                  8
+#define SKW_EVENT_BUF_SIZE               0x4000
+#define SKW_EVENT_RCVBUF_MAX             0x400000
+
+struct skw_event_rx {
+	bool no_mmsg;                                   // recvmmsg() not supported
+	struct mmsghdr msgs[SKW_EVENT_BATCH];
+	struct iovec iov[SKW_EVENT_BATCH];
+	struct sockaddr_nl addr[SKW_EVENT_BATCH];
+	char buf[SKW_EVENT_BATCH][SKW_EVENT_BUF_SIZE];
+};
+
+static int skw_event_stats_dump(hal_info *hal, char *buf, int size);
+
 struct nl_sock *getSock(wifi_interface_handle handle)
 {
 	interface_info *info = (interface_info *)handle;
@@ -99,7 +115,7 @@ public:
 		: WifiCommand(sk, family, flags, nl80211_cmd)
 	{
 		index = 0;
-		memset(ifaces, 0x0, sizeof(interface_info));
+		memset(ifaces, 0x0, sizeof(ifaces));
 	}
 
 	virtual wifi_error build(wifi_interface_handle handle, void *param)
@@ -109,13 +125,21 @@ public:
 
 	virtual wifi_error parser(struct nlattr *attr[NL80211_ATTR_MAX])
 	{
+		if (index >= SKW_NR_IFACE) {
+			ALOGE("%s: more than %d interfaces, ignored", __func__, SKW_NR_IFACE);
+			return WIFI_ERROR_OUT_OF_MEMORY;
+		}
+
 		if (attr[NL80211_ATTR_IFINDEX])
 			ifaces[index].iface_idx = nla_get_u32(attr[NL80211_ATTR_IFINDEX]);
-		else
+		else if (attr[NL80211_ATTR_WDEV])
 			ifaces[index].wdev_idx = nla_get_u32(attr[NL80211_ATTR_WDEV]);
+		else
+			return WIFI_ERROR_INVALID_ARGS;
 
 		if (attr[NL80211_ATTR_IFNAME])
-			strcpy(ifaces[index].name, nla_get_string(attr[NL80211_ATTR_IFNAME]));
+			strlcpy(ifaces[index].name, nla_get_string(attr[NL80211_ATTR_IFNAME]),
+				sizeof(ifaces[index].name));
 
 		index++;
 
@@ -133,13 +157,223 @@ public:
 	}
 };
 
-wifi_error skw_wifi_get_ifaces(wifi_handle handle, int *num, wifi_interface_handle **iface_handle)
+static u32 skw_iface_hash(u32 key)
+{
+	return (key * 0x9E3779B1) >> 16 & (SKW_IFACE_HASH_SIZE - 1);
+}
+
+static void skw_iface_map_add(int *map, u32 hash, int slot)
+{
+	while (map[hash])
+		hash = (hash + 1) & (SKW_IFACE_HASH_SIZE - 1);
+
+	map[hash] = slot + 1;
+}
+
+/* The lookups below expect hal->iface_lock to be held */
+static interface_info *skw_iface_by_ifindex(hal_info *hal, int ifindex)
+{
+	int i, slot;
+	u32 hash = skw_iface_hash(ifindex);
+
+	for (i = 0; i < SKW_IFACE_HASH_SIZE; i++) {
+		slot = hal->iface_by_ifindex[(hash + i) & (SKW_IFACE_HASH_SIZE - 1)];
+		if (slot == 0)
+			break;
+
+		if (hal->interfaces[slot - 1].iface_idx == ifindex)
+			return &hal->interfaces[slot - 1];
+	}
+
+	return NULL;
+}
+
+static interface_info *skw_iface_by_wdev(hal_info *hal, int wdev)
+{
+	int i, slot;
+	u32 hash = skw_iface_hash(wdev);
+
+	for (i = 0; i < SKW_IFACE_HASH_SIZE; i++) {
+		slot = hal->iface_by_wdev[(hash + i) & (SKW_IFACE_HASH_SIZE - 1)];
+		if (slot == 0)
+			break;
+
+		if (hal->interfaces[slot - 1].wdev_idx == wdev)
+			return &hal->interfaces[slot - 1];
+	}
+
+	return NULL;
+}
+
+static bool skw_iface_unused(interface_info *iface)
+{
+	return !iface->iface_idx && !iface->wdev_idx;
+}
+
+/*
+ * Rebuild the lookup maps after the table changed. The handle list given
+ * to the framework is not touched here, skw_wifi_get_ifaces() builds it.
+ */
+static void skw_iface_reindex(hal_info *hal)
 {
 	int i;
-	hal_info *hal = (hal_info *)handle;
+	interface_info *iface;
+
+	memset(hal->iface_by_ifindex, 0, sizeof(hal->iface_by_ifindex));
+	memset(hal->iface_by_wdev, 0, sizeof(hal->iface_by_wdev));
+
+	for (i = 0; i < SKW_NR_IFACE; i++) {
+		iface = &hal->interfaces[i];
+		if (skw_iface_unused(iface))
+			continue;
+
+		if (iface->iface_idx)
+			skw_iface_map_add(hal->iface_by_ifindex, skw_iface_hash(iface->iface_idx), i);
+
+		if (iface->wdev_idx)
+			skw_iface_map_add(hal->iface_by_wdev, skw_iface_hash(iface->wdev_idx), i);
+	}
+}
+
+/* events were dropped, the next query dumps the table again */
+static void skw_iface_invalidate(hal_info *hal)
+{
+	pthread_mutex_lock(&hal->iface_lock);
+
+	// also fails a dump already in flight, it may have missed the lost events
+	hal->iface_gen++;
+	hal->ifaces_cached = false;
+
+	pthread_mutex_unlock(&hal->iface_lock);
+}
+
+static interface_info *skw_iface_find(hal_info *hal, int ifindex, int wdev)
+{
+	if (ifindex)
+		return skw_iface_by_ifindex(hal, ifindex);
+
+	if (wdev)
+		return skw_iface_by_wdev(hal, wdev);
+
+	return NULL;
+}
+
+/*
+ * Pick a free slot for a new interface. A handle the framework still holds
+ * for a removed interface points at its old slot, and once the slot is
+ * reused that handle refers to the new interface. Prefer the slot that last
+ * held the same name, so the handle keeps meaning the same interface to the
+ * framework, otherwise go round the table so a freed slot is reused last.
+ */
+static interface_info *skw_iface_alloc(hal_info *hal, const char *name)
+{
+	int i, slot;
+	interface_info *iface;
+
+	for (i = 0; name && i < SKW_NR_IFACE; i++) {
+		iface = &hal->interfaces[i];
+		if (skw_iface_unused(iface) && !strcmp(iface->name, name))
+			return iface;
+	}
+
+	for (i = 0; i < SKW_NR_IFACE; i++) {
+		slot = (hal->iface_next + i) % SKW_NR_IFACE;
+		iface = &hal->interfaces[slot];
+		if (skw_iface_unused(iface)) {
+			hal->iface_next = (slot + 1) % SKW_NR_IFACE;
+			return iface;
+		}
+	}
+
+	return NULL;
+}
+
+/* add or refresh one interface, caller holds hal->iface_lock */
+static void skw_iface_update(hal_info *hal, int ifindex, int wdev, const char *name)
+{
+	interface_info *iface = skw_iface_find(hal, ifindex, wdev);
+
+	if (iface == NULL)
+		iface = skw_iface_alloc(hal, name);
+
+	if (iface == NULL) {
+		ALOGE("%s: no room for %s", __func__, name ? name : "");
+		return;
+	}
+
+	// same rule as the dump, wdev is only kept for netdev-less interfaces
+	iface->iface_idx = ifindex;
+	iface->wdev_idx = ifindex ? 0 : wdev;
+	iface->hal_handle = (wifi_handle)hal;
+
+	if (name)
+		strlcpy(iface->name, name, sizeof(iface->name));
+}
+
+static void skw_iface_remove(hal_info *hal, interface_info *iface)
+{
+	// keep hal_handle and name, a stale handle must still resolve its
+	// socket, and the name lets a recreated interface take the slot back
+	iface->iface_idx = 0;
+	iface->wdev_idx = 0;
+}
+
+static void skw_iface_event(hal_info *hal, struct nlattr *attr[], bool add)
+{
+	int ifindex = 0, wdev = 0;
+	const char *name = NULL;
+	interface_info *iface;
+
+	if (attr[NL80211_ATTR_IFINDEX])
+		ifindex = nla_get_u32(attr[NL80211_ATTR_IFINDEX]);
+
+	if (attr[NL80211_ATTR_WDEV])
+		wdev = nla_get_u32(attr[NL80211_ATTR_WDEV]);
+
+	if (attr[NL80211_ATTR_IFNAME])
+		name = nla_get_string(attr[NL80211_ATTR_IFNAME]);
+
+	pthread_mutex_lock(&hal->iface_lock);
+
+	hal->iface_gen++;
+
+	if (add) {
+		skw_iface_update(hal, ifindex, wdev, name);
+	} else {
+		iface = skw_iface_find(hal, ifindex, wdev);
+		if (iface)
+			skw_iface_remove(hal, iface);
+	}
+
+	skw_iface_reindex(hal);
+
+	pthread_mutex_unlock(&hal->iface_lock);
+
+	ALOGD("%s: %s %s, ifindex: %d, wdev: %d", __func__, add ? "new" : "del",
+		name ? name : "", ifindex, wdev);
+}
+
+static void skw_iface_new_event(wifi_handle handle, struct nlattr *attr[], void *ctx)
+{
+	skw_iface_event((hal_info *)handle, attr, true);
+}
+
+static void skw_iface_del_event(wifi_handle handle, struct nlattr *attr[], void *ctx)
+{
+	skw_iface_event((hal_info *)handle, attr, false);
+}
+
+/* dump all interfaces and make the cache match */
+static wifi_error skw_iface_refresh(hal_info *hal)
+{
+	u32 gen;
+	int i, j;
+	interface_info *iface;
 	GetInterfacesCommand cmd(hal->nl_hal, hal->family_nl80211, NLM_F_DUMP, NL80211_CMD_GET_INTERFACE);
 
-	memset(hal->interfaces, 0x0, sizeof(hal->interfaces));
+	pthread_mutex_lock(&hal->iface_lock);
+	gen = hal->iface_gen;
+	pthread_mutex_unlock(&hal->iface_lock);
 
 	cmd.build(NULL, NULL);
 	cmd.send();
@@ -147,20 +381,72 @@ wifi_error skw_wifi_get_ifaces(wifi_handle handle, int *num, wifi_interface_hand
 	if (cmd.getIfaceNum() == 0)
 		return WIFI_ERROR_UNKNOWN;
 
-	hal->nr_interfaces = cmd.getIfaceNum();
+	pthread_mutex_lock(&hal->iface_lock);
 
-	for (i = 0; i < hal->nr_interfaces; i++) {
-		strcpy(hal->interfaces[i].name, cmd.iface(i)->name);
-		hal->interfaces[i].iface_idx = cmd.iface(i)->iface_idx;
-		hal->interfaces[i].wdev_idx = cmd.iface(i)->wdev_idx;
-		hal->interfaces[i].hal_handle = handle;
+	for (i = 0; i < SKW_NR_IFACE; i++) {
+		iface = &hal->interfaces[i];
+		if (skw_iface_unused(iface))
+			continue;
 
-		hal->interface_handle[i] = (wifi_interface_handle)(&hal->interfaces[i]);
+		for (j = 0; j < cmd.getIfaceNum(); j++) {
+			if (iface->iface_idx == cmd.iface(j)->iface_idx &&
+			    iface->wdev_idx == cmd.iface(j)->wdev_idx)
+				break;
+		}
+
+		if (j == cmd.getIfaceNum())
+			skw_iface_remove(hal, iface);
+	}
+
+	for (j = 0; j < cmd.getIfaceNum(); j++)
+		skw_iface_update(hal, cmd.iface(j)->iface_idx, cmd.iface(j)->wdev_idx,
+				cmd.iface(j)->name);
+
+	skw_iface_reindex(hal);
+
+	// an event raced with the dump, dump again on the next query
+	hal->ifaces_cached = (gen == hal->iface_gen);
+
+	pthread_mutex_unlock(&hal->iface_lock);
+
+	return WIFI_SUCCESS;
+}
+
+/*
+ * The handle list is only written here, so the array the framework walks
+ * changes only when it asks again, not under it from the event thread.
+ */
+wifi_error skw_wifi_get_ifaces(wifi_handle handle, int *num, wifi_interface_handle **iface_handle)
+{
+	int i;
+	bool cached;
+	wifi_error err;
+	hal_info *hal = (hal_info *)handle;
+
+	pthread_mutex_lock(&hal->iface_lock);
+	cached = hal->ifaces_cached;
+	pthread_mutex_unlock(&hal->iface_lock);
+
+	if (!cached) {
+		err = skw_iface_refresh(hal);
+		if (err != WIFI_SUCCESS)
+			return err;
+	}
+
+	pthread_mutex_lock(&hal->iface_lock);
+
+	hal->nr_interfaces = 0;
+	for (i = 0; i < SKW_NR_IFACE; i++) {
+		if (!skw_iface_unused(&hal->interfaces[i]))
+			hal->interface_handle[hal->nr_interfaces++] =
+				(wifi_interface_handle)&hal->interfaces[i];
 	}
 
 	*iface_handle = &hal->interface_handle[0];
 	*num = hal->nr_interfaces;
 
+	pthread_mutex_unlock(&hal->iface_lock);
+
 	return WIFI_SUCCESS;
 }
 
@@ -882,8 +1168,18 @@ wifi_error skw_wifi_configure_nd_offload(wifi_interface_handle iface, u8 enable)
 wifi_error skw_wifi_get_driver_memory_dump(wifi_interface_handle iface,
 		wifi_driver_memory_dump_callbacks callbacks)
 {
+	int len;
+	char buff[SKW_BUFF_SIZE * 2];
+
 	ALOGD("%s", __func__);
 
+	len = skw_event_stats_dump(getHalInfo(iface), buff, sizeof(buff));
+	if (len > (int)sizeof(buff) - 1)
+		len = sizeof(buff) - 1;
+
+	if (callbacks.on_driver_memory_dump)
+		callbacks.on_driver_memory_dump(buff, len);
+
 	return WIFI_SUCCESS;
 }
 
@@ -1909,17 +2205,339 @@ static int skw_add_membership(struct nl_sock *sk, const char *group)
 	return ret;
 }
 
-static int evtHandler(struct nl_msg *msg, void *arg)
+static u32 skw_event_hash(u32 cmd, u32 oui, u32 subcmd)
 {
-	ALOGD("%s", __func__);
+	u32 h = (cmd * 0x9E3779B1) ^ (oui * 0x85EBCA6B) ^ (subcmd * 0xC2B2AE35);
 
-	return NL_SKIP;
+	return (h ^ (h >> 16)) & (SKW_EVENT_CB_SIZE - 1);
 }
 
-static wifi_error skw_wifi_event_init(hal_info *hal)
+/*
+ * Caller holds hal->cb_lock. Handlers run unlocked, wait until the old
+ * handler of cb has returned so that the caller may free its ctx. A
+ * handler that changes its own entry does not wait for itself.
+ */
+static void skw_event_cb_sync(hal_info *hal, struct skw_event_cb *cb)
 {
-	int err;
+	while (hal->cb_running == cb && !pthread_equal(hal->cb_thread, pthread_self()))
+		pthread_cond_wait(&hal->cb_cond, &hal->cb_lock);
+}
+
+/* caller holds hal->cb_lock */
+static struct skw_event_cb *skw_event_cb_find(hal_info *hal, u32 cmd, u32 oui, u32 subcmd)
+{
+	int i;
+	u32 idx = skw_event_hash(cmd, oui, subcmd);
+
+	for (i = 0; i < SKW_EVENT_CB_SIZE; i++) {
+		struct skw_event_cb *cb = &hal->event_cb[(idx + i) & (SKW_EVENT_CB_SIZE - 1)];
 
+		if (cb->state == SKW_EVENT_CB_EMPTY)
+			break;
+
+		if (cb->state == SKW_EVENT_CB_USED && cb->cmd == cmd &&
+		    cb->oui == oui && cb->subcmd == subcmd)
+			return cb;
+	}
+
+	return NULL;
+}
+
+wifi_error skw_register_event_handler(wifi_handle handle, u32 cmd, u32 oui,
+		u32 subcmd, skw_event_handler handler, void *ctx)
+{
+	int i;
+	struct skw_event_cb *cb;
+	hal_info *hal = (hal_info *)handle;
+	u32 idx = skw_event_hash(cmd, oui, subcmd);
+
+	pthread_mutex_lock(&hal->cb_lock);
+
+	cb = skw_event_cb_find(hal, cmd, oui, subcmd);
+	if (cb == NULL) {
+		// keep empty slots around so that misses stop probing early
+		if (hal->num_event_cb >= SKW_EVENT_CB_SIZE * 3 / 4) {
+			pthread_mutex_unlock(&hal->cb_lock);
+
+			ALOGE("%s: table full, cmd: %d, oui: 0x%x, subcmd: 0x%x",
+				__func__, cmd, oui, subcmd);
+
+			return WIFI_ERROR_TOO_MANY_REQUESTS;
+		}
+
+		for (i = 0; i < SKW_EVENT_CB_SIZE; i++) {
+			cb = &hal->event_cb[(idx + i) & (SKW_EVENT_CB_SIZE - 1)];
+			if (cb->state != SKW_EVENT_CB_USED)
+				break;
+		}
+
+		cb->cmd = cmd;
+		cb->oui = oui;
+		cb->subcmd = subcmd;
+		cb->state = SKW_EVENT_CB_USED;
+
+		hal->num_event_cb++;
+	} else {
+		skw_event_cb_sync(hal, cb);
+	}
+
+	cb->handler = handler;
+	cb->ctx = ctx;
+
+	pthread_mutex_unlock(&hal->cb_lock);
+
+	return WIFI_SUCCESS;
+}
+
+void skw_unregister_event_handler(wifi_handle handle, u32 cmd, u32 oui, u32 subcmd)
+{
+	struct skw_event_cb *cb;
+	hal_info *hal = (hal_info *)handle;
+
+	pthread_mutex_lock(&hal->cb_lock);
+
+	cb = skw_event_cb_find(hal, cmd, oui, subcmd);
+	if (cb) {
+		skw_event_cb_sync(hal, cb);
+
+		cb->state = SKW_EVENT_CB_DELETED;
+		cb->handler = NULL;
+		cb->ctx = NULL;
+
+		hal->num_event_cb--;
+	}
+
+	pthread_mutex_unlock(&hal->cb_lock);
+}
+
+static void skw_event_dispatch(hal_info *hal, struct nlmsghdr *hdr)
+{
+	void *ctx = NULL;
+	u32 oui = 0, subcmd = 0;
+	struct skw_event_cb *cb;
+	skw_event_handler handler = NULL;
+	struct nlattr *attr[NL80211_ATTR_MAX + 1];
+	struct genlmsghdr *gnlh = (struct genlmsghdr *)nlmsg_data(hdr);
+
+	nla_parse(attr, NL80211_ATTR_MAX, genlmsg_attrdata(gnlh, 0),
+			genlmsg_attrlen(gnlh, 0), NULL);
+
+	if (gnlh->cmd == NL80211_CMD_VENDOR) {
+		if (attr[NL80211_ATTR_VENDOR_ID])
+			oui = nla_get_u32(attr[NL80211_ATTR_VENDOR_ID]);
+
+		if (attr[NL80211_ATTR_VENDOR_SUBCMD])
+			subcmd = nla_get_u32(attr[NL80211_ATTR_VENDOR_SUBCMD]);
+	}
+
+	pthread_mutex_lock(&hal->cb_lock);
+
+	cb = skw_event_cb_find(hal, gnlh->cmd, oui, subcmd);
+	if (cb && cb->handler) {
+		handler = cb->handler;
+		ctx = cb->ctx;
+
+		hal->cb_running = cb;
+		hal->cb_thread = pthread_self();
+	}
+
+	pthread_mutex_unlock(&hal->cb_lock);
+
+	if (handler == NULL)
+		return;
+
+	// called unlocked so handlers may (un)register from the callback,
+	// (un)register from other threads waits for it to return
+	handler((wifi_handle)hal, attr, ctx);
+
+	pthread_mutex_lock(&hal->cb_lock);
+	hal->cb_running = NULL;
+	pthread_cond_broadcast(&hal->cb_cond);
+	pthread_mutex_unlock(&hal->cb_lock);
+}
+
+static int skw_event_recv(int fd, struct skw_event_rx *rx)
+{
+	int i, n;
+
+	for (i = 0; i < SKW_EVENT_BATCH; i++) {
+		rx->msgs[i].msg_hdr.msg_namelen = sizeof(rx->addr[i]);
+		rx->msgs[i].msg_hdr.msg_flags = 0;
+		rx->msgs[i].msg_len = 0;
+	}
+
+	if (!rx->no_mmsg) {
+		n = recvmmsg(fd, rx->msgs, SKW_EVENT_BATCH, MSG_DONTWAIT, NULL);
+		if (n >= 0 || errno != ENOSYS)
+			return n;
+
+		ALOGD("%s: recvmmsg not supported, use recvmsg", __func__);
+		rx->no_mmsg = true;
+	}
+
+	n = recvmsg(fd, &rx->msgs[0].msg_hdr, MSG_DONTWAIT);
+	if (n < 0)
+		return n;
+
+	rx->msgs[0].msg_len = n;
+
+	return 1;
+}
+
+static void skw_event_tune_rcvbuf(hal_info *hal, int fd, bool overrun)
+{
+	int size;
+	socklen_t len = sizeof(size);
+	struct skw_event_stats *stats = &hal->event_stats;
+
+	if (stats->rcvbuf_capped || stats->rcvbuf >= SKW_EVENT_RCVBUF_MAX)
+		return;
+
+	// the kernel charges skb truesize, about twice the payload of an
+	// event, keep the observed burst within half of the buffer
+	if (!overrun && stats->bytes_hwm * 4 < (u32)stats->rcvbuf)
+		return;
+
+	// SO_RCVBUF reads back doubled, asking for that value doubles it
+	size = stats->rcvbuf;
+	if (setsockopt(fd, SOL_SOCKET, SO_RCVBUFFORCE, &size, sizeof(size)) < 0)
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+
+	if (getsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, &len) < 0 || size <= stats->rcvbuf) {
+		ALOGE("%s: rcvbuf stays at %d", __func__, stats->rcvbuf);
+		stats->rcvbuf_capped = true;
+
+		return;
+	}
+
+	ALOGD("%s: rcvbuf %d -> %d, burst hwm: %u bytes, overrun: %d",
+		__func__, stats->rcvbuf, size, stats->bytes_hwm, overrun);
+
+	stats->rcvbuf = size;
+	stats->rcvbuf_grows++;
+}
+
+static void skw_event_rx_init(hal_info *hal)
+{
+	int i, size = 0;
+	socklen_t len = sizeof(size);
+	struct skw_event_rx *rx = hal->event_rx;
+
+	memset(rx, 0, offsetof(struct skw_event_rx, buf));
+
+	for (i = 0; i < SKW_EVENT_BATCH; i++) {
+		rx->iov[i].iov_base = rx->buf[i];
+		rx->iov[i].iov_len = SKW_EVENT_BUF_SIZE;
+
+		rx->msgs[i].msg_hdr.msg_name = &rx->addr[i];
+		rx->msgs[i].msg_hdr.msg_iov = &rx->iov[i];
+		rx->msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	getsockopt(nl_socket_get_fd(hal->nl_event), SOL_SOCKET, SO_RCVBUF, &size, &len);
+	hal->event_stats.rcvbuf = size;
+}
+
+/* drain every datagram queued on the event socket */
+static int skw_socket_handler(hal_info *hal, int events, struct nl_sock *sk)
+{
+	int i, n, len;
+	u32 nr = 0, bytes = 0;
+	bool overrun = false;
+	struct nlmsghdr *hdr;
+	struct skw_event_rx *rx = hal->event_rx;
+	struct skw_event_stats *stats = &hal->event_stats;
+	int fd = nl_socket_get_fd(sk);
+
+	stats->wakeups++;
+
+	for (;;) {
+		n = skw_event_recv(fd, rx);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+
+			// the kernel reports the overrun once, then delivers again
+			if (errno == ENOBUFS) {
+				stats->overruns++;
+				overrun = true;
+
+				// interface events may be among the dropped ones
+				skw_iface_invalidate(hal);
+
+				ALOGE("%s: event socket overrun, total: %llu", __func__,
+					(unsigned long long)stats->overruns);
+
+				continue;
+			}
+
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				ALOGE("%s: recv failed: %s", __func__, strerror(errno));
+
+			break;
+		}
+
+		for (i = 0; i < n; i++) {
+			len = rx->msgs[i].msg_len;
+			bytes += len;
+
+			if (rx->msgs[i].msg_hdr.msg_flags & MSG_TRUNC) {
+				stats->truncated++;
+				continue;
+			}
+
+			if (rx->addr[i].nl_pid != 0)
+				continue;
+
+			for (hdr = (struct nlmsghdr *)rx->buf[i]; nlmsg_ok(hdr, len);
+			     hdr = nlmsg_next(hdr, &len)) {
+				if (hdr->nlmsg_type == hal->family_nl80211)
+					skw_event_dispatch(hal, hdr);
+			}
+		}
+
+		nr += n;
+
+		// a short batch means the queue is empty
+		if (n < SKW_EVENT_BATCH && !rx->no_mmsg)
+			break;
+	}
+
+	stats->datagrams += nr;
+	stats->bytes += bytes;
+
+	if (nr > stats->batch_hwm)
+		stats->batch_hwm = nr;
+
+	if (bytes > stats->bytes_hwm || overrun) {
+		if (bytes > stats->bytes_hwm)
+			stats->bytes_hwm = bytes;
+
+		skw_event_tune_rcvbuf(hal, fd, overrun);
+	}
+
+	return nr;
+}
+
+static int skw_event_stats_dump(hal_info *hal, char *buf, int size)
+{
+	struct skw_event_stats *stats = &hal->event_stats;
+
+	return snprintf(buf, size,
+			"event socket: wakeups %llu datagrams %llu bytes %llu\n"
+			"overruns %llu truncated %llu\n"
+			"batch hwm %u, bytes hwm %u, rcvbuf %d (grown %d times%s)\n",
+			(unsigned long long)stats->wakeups,
+			(unsigned long long)stats->datagrams,
+			(unsigned long long)stats->bytes,
+			(unsigned long long)stats->overruns,
+			(unsigned long long)stats->truncated,
+			stats->batch_hwm, stats->bytes_hwm, stats->rcvbuf,
+			stats->rcvbuf_grows, stats->rcvbuf_capped ? ", capped" : "");
+}
+
+static wifi_error skw_wifi_event_init(hal_info *hal)
+{
 	hal->nl_event = skw_create_socket(WIFI_HAL_SOCK_EVENT_PORT);
 	if (hal->nl_event == NULL) {
 		ALOGE("%s: create event socket failed", __func__);
@@ -1927,13 +2545,23 @@ static wifi_error skw_wifi_event_init(hal_info *hal)
 		return WIFI_ERROR_UNKNOWN;
 	}
 
-	//nl_socket_modify_cb(hal->nl_event, NL_CB_SEQ_CHECK, no_seq_check, &err);
-	nl_socket_modify_cb(hal->nl_event, NL_CB_VALID, NL_CB_CUSTOM, evtHandler, &err);
+	hal->event_rx = (struct skw_event_rx *)malloc(sizeof(struct skw_event_rx));
+	if (hal->event_rx == NULL) {
+		ALOGE("%s: alloc event rx buffers failed", __func__);
+
+		nl_socket_free(hal->nl_event);
+		hal->nl_event = NULL;
+
+		return WIFI_ERROR_OUT_OF_MEMORY;
+	}
+
+	skw_event_rx_init(hal);
 
 	skw_add_membership(hal->nl_event, "scan");
 	skw_add_membership(hal->nl_event, "mlme");
 	skw_add_membership(hal->nl_event, "vendor");
 	skw_add_membership(hal->nl_event, "regulatory");
+	skw_add_membership(hal->nl_event, "config");
 
 	return WIFI_SUCCESS;
 }
@@ -1942,6 +2570,8 @@ static void skw_wifi_event_deinit(hal_info *hal)
 {
 	if (hal->nl_event)
 		nl_socket_free(hal->nl_event);
+
+	free(hal->event_rx);
 }
 
 static wifi_error skw_wifi_hal_init(hal_info *hal)
@@ -1962,13 +2592,17 @@ static wifi_error skw_wifi_hal_init(hal_info *hal)
 		return WIFI_ERROR_UNKNOWN;
 	}
 
+	skw_cmd_pool_init(&hal->cmd_pool, hal->nl_hal);
+
 	return WIFI_SUCCESS;
 }
 
 static void skw_wifi_hal_deinit(hal_info *hal)
 {
-	if (hal->nl_hal)
+	if (hal->nl_hal) {
+		skw_cmd_pool_deinit(&hal->cmd_pool);
 		nl_socket_free(hal->nl_hal);
+	}
 }
 
 static wifi_error skw_wifi_initialize(wifi_handle *handle)
@@ -1987,6 +2621,10 @@ static wifi_error skw_wifi_initialize(wifi_handle *handle)
 
 	memset(hal, 0, sizeof(*hal));
 
+	pthread_mutex_init(&hal->cb_lock, NULL);
+	pthread_cond_init(&hal->cb_cond, NULL);
+	pthread_mutex_init(&hal->iface_lock, NULL);
+
 	if (socketpair(AF_UNIX, SOCK_STREAM, 0, hal->exit_socks) == -1) {
 		ALOGE("socketpair failed");
 
@@ -2009,6 +2647,11 @@ static wifi_error skw_wifi_initialize(wifi_handle *handle)
 		return err;
 	}
 
+	skw_register_event_handler((wifi_handle)hal, NL80211_CMD_NEW_INTERFACE, 0, 0,
+				skw_iface_new_event, NULL);
+	skw_register_event_handler((wifi_handle)hal, NL80211_CMD_DEL_INTERFACE, 0, 0,
+				skw_iface_del_event, NULL);
+
 	*handle = (wifi_handle)hal;
 
 	return WIFI_SUCCESS;
@@ -2016,11 +2659,15 @@ static wifi_error skw_wifi_initialize(wifi_handle *handle)
 
 static void skw_wifi_deinitialize(wifi_handle handle)
 {
+	char buff[SKW_BUFF_SIZE * 2];
 	hal_info *hal = (hal_info *)handle;
 
 	if (hal->cleaned_up_handler)
 		(*(hal->cleaned_up_handler))(handle);
 
+	if (skw_event_stats_dump(hal, buff, sizeof(buff)) > 0)
+		ALOGD("%s", buff);
+
 	skw_wifi_hal_deinit(hal);
 	skw_wifi_event_deinit(hal);
 
@@ -2030,6 +2677,10 @@ static void skw_wifi_deinitialize(wifi_handle handle)
 	if (hal->exit_socks[1])
 		close(hal->exit_socks[1]);
 
+	pthread_mutex_destroy(&hal->cb_lock);
+	pthread_cond_destroy(&hal->cb_cond);
+	pthread_mutex_destroy(&hal->iface_lock);
+
 	free(hal);
 }
 
@@ -2045,21 +2696,9 @@ void skw_wifi_cleanup(wifi_handle handle, wifi_cleaned_up_handler clean_handler)
 	TEMP_FAILURE_RETRY(write(hal->exit_socks[0], "exit", 4));
 }
 
-static int skw_socket_handler(hal_info *hal, int events, struct nl_sock *sk)
-{
-	int ret;
-	struct nl_cb *cb = nl_socket_get_cb(sk);
-
-	ret = nl_recvmsgs(sk, cb);
-
-	nl_cb_put(cb);
-
-	return ret;
-}
-
 static void skw_wifi_event_loop(wifi_handle handle)
 {
-	pollfd fd[2];
+	pollfd fd[4];
 	hal_info *hal = (hal_info *)handle;
 
 	ALOGD("%s", __func__);
@@ -2076,10 +2715,18 @@ static void skw_wifi_event_loop(wifi_handle handle)
 		fd[0].revents = 0;
 		fd[1].revents = 0;
 
-		if (poll(fd, 2, -1) > 0) {
+		// replies of async commands nobody is waiting on
+		skw_cmd_pool_poll_fds(&hal->cmd_pool, &fd[2], &fd[3]);
+		fd[2].revents = 0;
+		fd[3].revents = 0;
+
+		if (poll(fd, 4, -1) > 0) {
 			if (fd[0].revents & POLLIN) {
 				skw_socket_handler(hal, fd[0].revents, hal->nl_event);
 			}
+
+			if ((fd[2].revents | fd[3].revents) & POLLIN)
+				skw_cmd_pool_pump(&hal->cmd_pool);
 		}
 
 	} while (!hal->exit);
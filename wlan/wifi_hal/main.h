@@ -26,6 +26,9 @@
 
 #define OUI_GOOGLE               0x001A11
 #define SKW_NR_IFACE             8
+#define SKW_IFACE_HASH_SIZE      16              // power of two, > SKW_NR_IFACE
+#define SKW_CMD_POOL_SIZE        4
+#define SKW_EVENT_CB_SIZE        32              // power of two
 
 #define SKW_INVALID              -1
 #define SKW_BIT(nr)              (1 << (nr))
@@ -89,10 +92,70 @@ typedef struct {
 	char name[IFNAMSIZ+1];                         // interface name + trailing null
 } interface_info;
 
+class WifiCommand;
+
+// requests reuse the slot messages, replies are still allocated by libnl
+// for every datagram (nl_recv) and message (nlmsg_convert)
+struct skw_cmd_slot {
+	struct nl_msg *msg;                            // preallocated request message
+	bool busy;
+};
+
+typedef struct skw_cmd_pool {
+	pthread_mutex_t lock;                          // protects slots and pending list
+	pthread_cond_t cond;                           // signaled after each receive round
+	struct nl_sock *sock;                          // socket the pool is bound to
+	struct nl_cb *cb;                              // dispatches replies by sequence
+	bool reading;                                  // a thread is receiving on sock
+	pthread_t reader;
+	WifiCommand *pending;                          // commands waiting for a reply
+	int nr_async;                                  // pending commands with a handler
+	int wake[2];                                   // tells the event loop to recheck nr_async
+	int nr_slots;
+	struct skw_cmd_slot slot[SKW_CMD_POOL_SIZE];
+	struct skw_cmd_pool *next;                     // registered pools
+} skw_cmd_pool;
+
+/* called from the event loop with the parsed nl80211 attributes */
+typedef void (*skw_event_handler)(wifi_handle handle, struct nlattr *attr[], void *ctx);
+
+enum SKW_EVENT_CB_STATE {
+	SKW_EVENT_CB_EMPTY,
+	SKW_EVENT_CB_USED,
+	SKW_EVENT_CB_DELETED,
+};
+
+struct skw_event_cb {
+	u32 cmd;                                       // nl80211 command
+	u32 oui;                                       // vendor id, 0 for non vendor events
+	u32 subcmd;                                    // vendor subcmd
+	int state;
+	skw_event_handler handler;
+	void *ctx;
+};
+
+struct skw_event_stats {
+	u64 wakeups;                                   // poll() wakeups on the event socket
+	u64 datagrams;
+	u64 bytes;
+	u64 overruns;                                  // ENOBUFS, multicast events were dropped
+	u64 truncated;                                 // datagrams larger than the rx buffer
+	u32 batch_hwm;                                 // most datagrams drained in one wakeup
+	u32 bytes_hwm;                                 // most bytes drained in one wakeup
+	int rcvbuf;                                    // SO_RCVBUF as reported by the kernel
+	int rcvbuf_grows;
+	bool rcvbuf_capped;                            // kernel refused to grow further
+};
+
+struct skw_event_rx;
+
 typedef struct {
 	struct nl_sock *nl_hal;                        // command socket object
 	struct nl_sock *nl_event;                      // event socket object
+	struct skw_event_rx *event_rx;                 // batch receive buffers for nl_event
+	struct skw_event_stats event_stats;
 	int family_nl80211;                            // family id for 80211 driver
+	skw_cmd_pool cmd_pool;                         // reusable messages for nl_hal
 
 	bool exit;                                     // Indication to exit since cleanup has started
 	int exit_socks[2];                             // sockets used to implement wifi_cleanup
@@ -101,19 +164,36 @@ typedef struct {
 	bool in_event_loop;                             // Indicates that event loop is active
 
 	pthread_mutex_t cb_lock;                        // mutex for the event_cb access
+	pthread_cond_t cb_cond;                         // signaled when a handler returns
+	struct skw_event_cb *cb_running;                // entry whose handler is being called
+	pthread_t cb_thread;                            // thread calling it, the event loop
+	int num_event_cb;                               // registered event handlers
+	struct skw_event_cb event_cb[SKW_EVENT_CB_SIZE];
 
 	int num_cmd;                                    // number of commands
 	int alloc_cmd;                                  // number of commands allocated
 
-	int nr_interfaces;
+	pthread_mutex_t iface_lock;                     // protects the interface cache
+	bool ifaces_cached;                             // kept current by events, cleared on overrun
+	u32 iface_gen;                                  // bumped on every interface event
+	int nr_interfaces;                              // handles in interface_handle
 	interface_info interfaces[SKW_NR_IFACE];
 	wifi_interface_handle interface_handle[SKW_NR_IFACE];
+	int iface_by_ifindex[SKW_IFACE_HASH_SIZE];      // slot + 1, 0 is empty
+	int iface_by_wdev[SKW_IFACE_HASH_SIZE];
+	int iface_next;                                 // next slot to try for a new interface
 
 	int max_num_interfaces;                         // max number of interfaces
 
 	// add other details
 } hal_info;
 
+// once they return, the previous handler of the event is not running any
+// more on another thread and its ctx may be freed
+wifi_error skw_register_event_handler(wifi_handle handle, u32 cmd, u32 oui,
+		u32 subcmd, skw_event_handler handler, void *ctx);
+void skw_unregister_event_handler(wifi_handle handle, u32 cmd, u32 oui, u32 subcmd);
+
 static inline hal_info *getHalInfo(wifi_interface_handle handle)
 {
     return (hal_info *)(((interface_info *)handle)->hal_handle);
@@ -16,6 +16,13 @@
  * limitations under the License.
  *
  **********************************************************************************/
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
 #include <netlink/genl/genl.h>
 
 #include "wifi_command.h"
@@ -55,14 +62,14 @@ static int msgHandler(struct nl_msg *msg, void *arg)
 	return NL_SKIP;
 }
 
-wifi_error sendMsg(struct nl_sock *sk, struct nl_msg *msg, void *arg)
+static wifi_error sendMsg(struct nl_sock *sk, struct nl_msg *msg, void *arg)
 {
 	int err;
 	struct nl_cb *cb;
 
-       	cb = nl_cb_alloc(NL_CB_DEFAULT);
+	cb = nl_cb_alloc(NL_CB_DEFAULT);
 	if (cb == NULL) {
-		ALOGE("%s: alloc cb failed");
+		ALOGE("%s: alloc cb failed", __func__);
 		return WIFI_ERROR_OUT_OF_MEMORY;
 	}
 
@@ -75,7 +82,7 @@ wifi_error sendMsg(struct nl_sock *sk, struct nl_msg *msg, void *arg)
 	while (err > 0) {
 		int res = nl_recvmsgs(sk, cb);
 		if (res < 0)
-			ALOGE("%s: recv msg failed: %d", res);
+			ALOGE("%s: recv msg failed: %d", __func__, res);
 	}
 
 	nl_cb_put(cb);
@@ -83,21 +90,476 @@ wifi_error sendMsg(struct nl_sock *sk, struct nl_msg *msg, void *arg)
 	return err ? WIFI_ERROR_UNKNOWN : WIFI_SUCCESS;
 }
 
+static skw_cmd_pool *cmd_pools = NULL;
+static pthread_mutex_t cmd_pools_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static uint64_t skw_now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+WifiCommand *skw_cmd_lookup(skw_cmd_pool *pool, uint32_t seq)
+{
+	WifiCommand *cmd;
+
+	pthread_mutex_lock(&pool->lock);
+	for (cmd = pool->pending; cmd; cmd = cmd->next) {
+		if (cmd->seq == seq)
+			break;
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	return cmd;
+}
+
+void skw_cmd_complete(skw_cmd_pool *pool, WifiCommand *cmd, wifi_error err)
+{
+	void *ctx;
+	skw_cmd_handler handler;
+
+	pthread_mutex_lock(&pool->lock);
+
+	cmd->unlinkLocked();
+	cmd->done = true;
+	cmd->result = err;
+
+	handler = cmd->handler;
+	ctx = cmd->handler_ctx;
+
+	pthread_mutex_unlock(&pool->lock);
+
+	// the handler owns cmd from here on and may delete it
+	if (handler)
+		handler(cmd, err, ctx);
+}
+
+static int seqCheckHandler(struct nl_msg *msg, void *arg)
+{
+	// several requests are in flight, sequence is matched per message
+	return NL_OK;
+}
+
+static int dispatchValid(struct nl_msg *msg, void *arg)
+{
+	WifiCommand *cmd = skw_cmd_lookup((skw_cmd_pool *)arg, nlmsg_hdr(msg)->nlmsg_seq);
+
+	if (cmd)
+		msgHandler(msg, cmd);
+
+	return NL_SKIP;
+}
+
+static int dispatchFinish(struct nl_msg *msg, void *arg)
+{
+	skw_cmd_pool *pool = (skw_cmd_pool *)arg;
+	WifiCommand *cmd = skw_cmd_lookup(pool, nlmsg_hdr(msg)->nlmsg_seq);
+
+	if (cmd)
+		skw_cmd_complete(pool, cmd, WIFI_SUCCESS);
+
+	return NL_SKIP;
+}
+
+static int dispatchError(struct sockaddr_nl *nla, struct nlmsgerr *err, void *arg)
+{
+	skw_cmd_pool *pool = (skw_cmd_pool *)arg;
+	WifiCommand *cmd = skw_cmd_lookup(pool, err->msg.nlmsg_seq);
+
+	// same result as sendMsg(), which does not report the kernel error
+	if (cmd)
+		skw_cmd_complete(pool, cmd, WIFI_SUCCESS);
+
+	return NL_SKIP;
+}
+
+static void skw_cmd_pool_kick(skw_cmd_pool *pool)
+{
+	if (pool->wake[1] >= 0)
+		TEMP_FAILURE_RETRY(write(pool->wake[1], "w", 1));
+}
+
+/* read until the non-blocking socket runs dry, returns the messages handled */
+static int skw_cmd_drain(skw_cmd_pool *pool)
+{
+	int res, nr = 0;
+
+	while ((res = nl_recvmsgs_report(pool->sock, pool->cb)) > 0)
+		nr += res;
+
+	if (res < 0 && res != -NLE_AGAIN)
+		ALOGE("%s: recv msg failed: %d", __func__, res);
+
+	return nr;
+}
+
+/*
+ * Receive and dispatch everything pending on pool->sock.
+ * Called with pool->lock held and pool->reading set by the caller.
+ */
+static void skw_cmd_recv(skw_cmd_pool *pool, int timeout_ms)
+{
+	struct pollfd pfd;
+
+	pool->reader = pthread_self();
+	pthread_mutex_unlock(&pool->lock);
+
+	pfd.fd = nl_socket_get_fd(pool->sock);
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+
+	// the kernel mostly queues the reply before send() returns,
+	// so read first and poll() only if nothing was there
+	if (skw_cmd_drain(pool) == 0 && timeout_ms &&
+	    poll(&pfd, 1, timeout_ms) > 0 && (pfd.revents & POLLIN))
+		skw_cmd_drain(pool);
+
+	pthread_mutex_lock(&pool->lock);
+	pool->reading = false;
+	pthread_cond_broadcast(&pool->cond);
+}
+
+/*
+ * Event loop side: only async commands with a handler need it to read
+ * pool->sock, and only while no waiter holds the reader role. Otherwise
+ * the socket stays out of the poll set, a waiter that finds async
+ * commands still pending kicks the wake pipe when it gives the role up.
+ */
+void skw_cmd_pool_poll_fds(skw_cmd_pool *pool, struct pollfd *wake, struct pollfd *sock)
+{
+	wake->fd = pool->wake[0];
+	wake->events = POLLIN;
+	sock->fd = -1;
+	sock->events = POLLIN;
+
+	if (pool->cb == NULL)
+		return;
+
+	pthread_mutex_lock(&pool->lock);
+
+	if (pool->nr_async && (!pool->reading || pool->wake[0] < 0))
+		sock->fd = nl_socket_get_fd(pool->sock);
+
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void skw_cmd_pool_pump(skw_cmd_pool *pool)
+{
+	char buf[32];
+
+	if (pool->cb == NULL)
+		return;
+
+	if (pool->wake[0] >= 0)
+		while (read(pool->wake[0], buf, sizeof(buf)) > 0)
+			;
+
+	pthread_mutex_lock(&pool->lock);
+
+	if (pool->nr_async && !pool->reading) {
+		pool->reading = true;
+		skw_cmd_recv(pool, 0);
+	}
+
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void skw_cmd_pool_init(skw_cmd_pool *pool, struct nl_sock *sk)
+{
+	int i;
+
+	memset(pool, 0, sizeof(*pool));
+
+	pool->sock = sk;
+	pool->wake[0] = pool->wake[1] = -1;
+	pool->cb = nl_cb_alloc(NL_CB_DEFAULT);
+	if (pool->cb == NULL) {
+		ALOGE("%s: alloc cb failed, commands stay synchronous", __func__);
+		return;
+	}
+
+	nl_cb_set(pool->cb, NL_CB_SEQ_CHECK, NL_CB_CUSTOM, seqCheckHandler, NULL);
+	nl_cb_err(pool->cb, NL_CB_CUSTOM, dispatchError, pool);
+	nl_cb_set(pool->cb, NL_CB_FINISH, NL_CB_CUSTOM, dispatchFinish, pool);
+	nl_cb_set(pool->cb, NL_CB_ACK, NL_CB_CUSTOM, dispatchFinish, pool);
+	nl_cb_set(pool->cb, NL_CB_VALID, NL_CB_CUSTOM, dispatchValid, pool);
+
+	pthread_mutex_init(&pool->lock, NULL);
+	pthread_cond_init(&pool->cond, NULL);
+
+	for (i = 0; i < SKW_CMD_POOL_SIZE; i++) {
+		pool->slot[i].msg = nlmsg_alloc();
+		if (pool->slot[i].msg == NULL)
+			break;
+	}
+
+	pool->nr_slots = i;
+	if (pool->nr_slots != SKW_CMD_POOL_SIZE)
+		ALOGE("%s: only %d/%d slots, falling back to per command alloc",
+			__func__, pool->nr_slots, SKW_CMD_POOL_SIZE);
+
+	// readers poll() first, a stolen datagram must not block them
+	nl_socket_set_nonblocking(sk);
+
+	if (pipe2(pool->wake, O_NONBLOCK | O_CLOEXEC) < 0) {
+		ALOGE("%s: wake pipe failed, event loop polls the socket", __func__);
+		pool->wake[0] = pool->wake[1] = -1;
+	}
+
+	pthread_mutex_lock(&cmd_pools_lock);
+	pool->next = cmd_pools;
+	cmd_pools = pool;
+	pthread_mutex_unlock(&cmd_pools_lock);
+}
+
+void skw_cmd_pool_deinit(skw_cmd_pool *pool)
+{
+	int i;
+	skw_cmd_pool **pp;
+
+	if (pool->cb == NULL)
+		return;
+
+	pthread_mutex_lock(&cmd_pools_lock);
+	for (pp = &cmd_pools; *pp; pp = &(*pp)->next) {
+		if (*pp == pool) {
+			*pp = pool->next;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&cmd_pools_lock);
+
+	if (pool->pending)
+		ALOGE("%s: commands still in flight", __func__);
+
+	for (i = 0; i < pool->nr_slots; i++) {
+		if (pool->slot[i].busy)
+			ALOGE("%s: slot %d still in use", __func__, i);
+
+		nlmsg_free(pool->slot[i].msg);
+	}
+
+	pool->nr_slots = 0;
+	nl_cb_put(pool->cb);
+	pool->cb = NULL;
+
+	if (pool->wake[0] >= 0) {
+		close(pool->wake[0]);
+		close(pool->wake[1]);
+	}
+
+	pthread_cond_destroy(&pool->cond);
+	pthread_mutex_destroy(&pool->lock);
+}
+
+static skw_cmd_pool *skw_cmd_pool_find(struct nl_sock *sk)
+{
+	skw_cmd_pool *pool;
+
+	pthread_mutex_lock(&cmd_pools_lock);
+	for (pool = cmd_pools; pool; pool = pool->next) {
+		if (pool->sock == sk)
+			break;
+	}
+	pthread_mutex_unlock(&cmd_pools_lock);
+
+	return pool;
+}
+
+static struct skw_cmd_slot *skw_cmd_slot_get(skw_cmd_pool *pool)
+{
+	int i;
+	struct skw_cmd_slot *slot = NULL;
+
+	pthread_mutex_lock(&pool->lock);
+	for (i = 0; i < pool->nr_slots; i++) {
+		if (!pool->slot[i].busy) {
+			slot = &pool->slot[i];
+			slot->busy = true;
+			break;
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+
+	if (slot) {
+		// drop the previous request, nl_complete_msg() refills
+		// port, sequence and request flags on every send
+		struct nlmsghdr *hdr = nlmsg_hdr(slot->msg);
+
+		memset(hdr, 0, NLMSG_HDRLEN);
+		hdr->nlmsg_len = NLMSG_HDRLEN;
+	}
+
+	return slot;
+}
+
+void WifiCommand::unlinkLocked()
+{
+	WifiCommand **pp;
+
+	for (pp = &pool->pending; *pp; pp = &(*pp)->next) {
+		if (*pp == this) {
+			*pp = next;
+			break;
+		}
+	}
+
+	if (pending && handler)
+		pool->nr_async--;
+
+	next = NULL;
+	pending = false;
+}
+
+wifi_error WifiCommand::sendAsync(skw_cmd_handler done_handler, void *ctx)
+{
+	int err;
+	bool kick = false;
+
+	if (msg == NULL)
+		return WIFI_ERROR_OUT_OF_MEMORY;
+
+	handler = done_handler;
+	handler_ctx = ctx;
+
+	if (pool == NULL) {
+		wifi_error ret;
+
+		// nobody dispatches on this socket, complete inline
+		ret = result = sendMsg(sock, msg, (void *)this);
+		done = true;
+
+		if (done_handler)
+			done_handler(this, ret, ctx);
+
+		return ret;
+	}
+
+	pthread_mutex_lock(&pool->lock);
+
+	nl_complete_msg(sock, msg);
+	seq = nlmsg_hdr(msg)->nlmsg_seq;
+
+	err = nl_send(sock, msg);
+	if (err >= 0) {
+		next = pool->pending;
+		pool->pending = this;
+		pending = true;
+
+		// the event loop reads for handlers nobody waits on
+		if (handler && pool->nr_async++ == 0)
+			kick = true;
+	}
+
+	pthread_mutex_unlock(&pool->lock);
+
+	if (kick)
+		skw_cmd_pool_kick(pool);
+
+	if (err < 0) {
+		ALOGE("%s: send seq %u failed: %d", __func__, seq, err);
+		done = true;
+
+		return WIFI_ERROR_UNKNOWN;
+	}
+
+	return WIFI_SUCCESS;
+}
+
+wifi_error WifiCommand::wait()
+{
+	wifi_error err;
+	uint64_t deadline = skw_now_ms() + SKW_CMD_TIMEOUT_MS;
+
+	if (pool == NULL)
+		return result;
+
+	pthread_mutex_lock(&pool->lock);
+
+	while (pending) {
+		if (pool->reading) {
+			pthread_cond_wait(&pool->cond, &pool->lock);
+			continue;
+		}
+
+		if (skw_now_ms() >= deadline) {
+			ALOGE("%s: seq %u timed out", __func__, seq);
+
+			unlinkLocked();
+			done = true;
+			result = WIFI_ERROR_TIMED_OUT;
+
+			break;
+		}
+
+		pool->reading = true;
+		skw_cmd_recv(pool, SKW_CMD_POLL_MS);
+
+		// the event loop left the socket to us, hand it back
+		if (pool->nr_async)
+			skw_cmd_pool_kick(pool);
+	}
+
+	err = result;
+
+	pthread_mutex_unlock(&pool->lock);
+
+	return err;
+}
+
 wifi_error WifiCommand::send()
 {
-	return sendMsg(sock, nlmsg(), (void *)this);
+	wifi_error err = sendAsync(NULL, NULL);
+	if (err != WIFI_SUCCESS)
+		return err;
+
+	return wait();
 }
 
 WifiCommand::~WifiCommand()
 {
-	nlmsg_free(msg);
+	if (pool) {
+		pthread_mutex_lock(&pool->lock);
+
+		// the reader may be inside our parser(), let it finish first
+		while (pending && pool->reading &&
+		       !pthread_equal(pool->reader, pthread_self()))
+			pthread_cond_wait(&pool->cond, &pool->lock);
+
+		if (pending)
+			unlinkLocked();
+
+		if (slot)
+			slot->busy = false;
+
+		pthread_mutex_unlock(&pool->lock);
+	}
+
+	if (slot == NULL)
+		nlmsg_free(msg);
 }
 
 WifiCommand::WifiCommand(struct nl_sock *sk, int family_id, int flags, int nl80211_cmd)
 {
 	sock = sk;
+	slot = NULL;
+
+	next = NULL;
+	seq = 0;
+	pending = false;
+	done = false;
+	result = WIFI_ERROR_UNKNOWN;
+	handler = NULL;
+	handler_ctx = NULL;
+
+	pool = skw_cmd_pool_find(sk);
+	if (pool)
+		slot = skw_cmd_slot_get(pool);
 
-	msg = nlmsg_alloc();
+	msg = slot ? slot->msg : nlmsg_alloc();
 	if (msg)
 		genlmsg_put(msg, 0, 0, family_id, 0, flags, nl80211_cmd, 0);
 	else
@@ -19,6 +19,8 @@
 #ifndef __WIFI_COMMAND_H__
 #define __WIFI_COMMAND_H__
 
+#include <poll.h>
+
 #include "main.h"
 #include "nl80211_copy.h"
 
@@ -36,16 +38,48 @@ enum SKW_SUBCMD_GET_VERSION {
 	SKW_FW_VERSION,
 };
 
+#define SKW_CMD_POLL_MS                         100
+#define SKW_CMD_TIMEOUT_MS                      5000
+
+/* called from the receiving thread once the reply of cmd is complete */
+typedef void (*skw_cmd_handler)(WifiCommand *cmd, wifi_error err, void *ctx);
+
+void skw_cmd_pool_init(skw_cmd_pool *pool, struct nl_sock *sk);
+void skw_cmd_pool_deinit(skw_cmd_pool *pool);
+void skw_cmd_pool_pump(skw_cmd_pool *pool);
+void skw_cmd_pool_poll_fds(skw_cmd_pool *pool, struct pollfd *wake, struct pollfd *sock);
+
 class WifiCommand {
 private:
 	struct nl_msg *msg;
 	struct nl_sock *sock;
 	int id;
+	skw_cmd_pool *pool;
+	struct skw_cmd_slot *slot;
+
+	WifiCommand *next;                  // link in pool->pending
+	uint32_t seq;                       // netlink sequence of the request
+	bool pending;
+	bool done;
+	wifi_error result;
+	skw_cmd_handler handler;
+	void *handler_ctx;
+
+	void unlinkLocked();
+
+	friend WifiCommand *skw_cmd_lookup(skw_cmd_pool *pool, uint32_t seq);
+	friend void skw_cmd_complete(skw_cmd_pool *pool, WifiCommand *cmd, wifi_error err);
 
 public:
 	WifiCommand(struct nl_sock *sk, int family_id, int flags, int nl80211_cmd);
 	wifi_error send();
 
+	// queue the request and return, replies are routed back by sequence;
+	// a command sent with a handler must not be waited on. No HAL entry
+	// point uses it yet, they all return their result to the caller
+	wifi_error sendAsync(skw_cmd_handler done_handler, void *ctx);
+	wifi_error wait();
+
 	virtual ~WifiCommand();
 	virtual wifi_error build(wifi_interface_handle handle, void *param) = 0;
 	// virtual wifi_error parser(struct nl_msg *msg) = 0;